@@ -6,6 +6,8 @@
 
 #include <string>
 #include <chrono>
+#include <cstring>
+#include <ctime>
 
 using namespace std;
 
@@ -28,26 +30,38 @@ string TIME::get()
 
 string TIME::mili()
 {
-    // Get the current time point
-    const auto now = chrono::system_clock::now();
+    return mili(chrono::system_clock::now());
+}
 
-    // Convert to time_t for seconds and tm for local time
-    const auto in_time_t = chrono::system_clock::to_time_t(now);
-    tm buf{};
-    localtime_r(&in_time_t, &buf);
+string TIME::mili(const chrono::system_clock::time_point now)
+{
+    char buf[MILI_LEN];
+    mili(buf, now);
+    return {buf, MILI_LEN};
+}
 
-    // Use stringstream to format the time
-    std::ostringstream ss;
-    ss << "[" << put_time(&buf, "%Y-%m-%d %H:%M:%S");
+void TIME::mili(char *out, const chrono::system_clock::time_point now)
+{
+    thread_local time_t cached_second = -1;
+    thread_local char   cached[MILI_LEN + 1] = "[YYYY-MM-DD HH:MM:SS.mmm]";
 
-    // Calculate milliseconds (now time since epoch minus time_t converted back to time since epoch)
-    auto since_epoch = now.time_since_epoch();
-    const auto s = chrono::duration_cast<chrono::seconds>(since_epoch);
-    since_epoch -= s;
-    const auto ms = chrono::duration_cast<chrono::milliseconds>(since_epoch);
+    const auto since_epoch = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count();
+    const auto second      = static_cast<time_t>(since_epoch / 1000);
+    const auto ms          = static_cast<int>(since_epoch % 1000);
 
-    // Append milliseconds to the formatted string, correctly placing the closing square bracket
-    ss << "." << setfill('0') << setw(3) << ms.count() << "]";
+    if (second != cached_second)
+    {
+        tm buf{};
+        localtime_r(&second, &buf);
 
-    return ss.str();
-}
\ No newline at end of file
+        /* Rewrites the 19 chars after '[', the terminator lands on the '.' which is restored right after */
+        strftime(cached + 1, 20, "%Y-%m-%d %H:%M:%S", &buf);
+        cached[20]    = '.';
+        cached_second = second;
+    }
+
+    cached[21] = static_cast<char>('0' + ms / 100);
+    cached[22] = static_cast<char>('0' + ms / 10 % 10);
+    cached[23] = static_cast<char>('0' + ms % 10);
+    memcpy(out, cached, MILI_LEN);
+}
@@ -68,6 +68,7 @@
 
 #include "globals.h"
 
+#include <chrono>
 #include <string>
 
 using namespace std;
@@ -75,8 +76,22 @@ using namespace std;
 class TIME
 {
 public:
+    /* Length of "[YYYY-MM-DD HH:MM:SS.mmm]" */
+    static constexpr size_t MILI_LEN = 25;
+
     static string get();
     static string mili();
+    static string mili(chrono::system_clock::time_point now);
+
+    /**
+     *
+     * @brief Allocation free 'mili', writes exactly 'MILI_LEN' chars to 'out' (no terminator).
+     *
+     * The date and time part is cached per thread and only rebuilt when the
+     * second changes, otherwise just the millisecond digits are patched in.
+     *
+     */
+    static void mili(char *out, chrono::system_clock::time_point now);
 };
 
 
@@ -0,0 +1,173 @@
+/*
+
+    MIT Open Source License
+
+    Copyright (c) 2024 Melwin Svensson
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in (the "Software") without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of (the "Software"), subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of (the "Software").
+
+    Any modifications to (the "Software") must include a prominent notice stating that
+    (the "Software") was created by Melwin Svensson, and that the modifications were made
+    by a different author. The notice must explicitly state that Melwin Svensson created
+    the precursor to the current work, and that (the "Software") has been modified since its
+    original creation. Additionally, a link to the original source code (https://github.com/mellw0101)
+    must be included in a format similar to the following:
+
+    "Melwin Svensson CREATED THE PRECURSOR TO 'the current file' AND IS THE SOLE OWNER AND AUTHOR OF THE PRECURSOR WORK."
+
+    All copies, substantial portions, and derivative works of (the "Software") must be distributed
+    under the exact same license (MIT Open Source License) including all clauses stated in this
+    notice, ensuring that (the "Software") remains free and open source forever.
+
+    Any distribution of (the "Software") in its entirety or in portions, including
+    any derivative works, must retain this license in its entirety and may not be
+    re-licensed under any other license than the same MIT Open Source License.
+    All clauses laid out in this notice must be upheld in all future licenses for (the "Software").
+
+    Any software that includes (the "Software") or any portions of (the "Software") must also be
+    open source and distributed under a license that complies with the Open Source Definition
+    (https://opensource.org/osd).
+
+    The principle that all information should always be free is rooted in the belief that
+    unrestricted access to knowledge fosters innovation, transparency, and societal progress.
+    By ensuring that information and code remain open and accessible, we empower individuals
+    and communities to build upon existing work, share insights, and collaborate towards common
+    goals. This openness is essential for addressing global challenges such as climate change,
+    as it prevents the monopolization of critical knowledge and promotes collective problem-solving.
+    Free access to information also holds powerful entities accountable, as it limits their ability
+    to obscure facts or manipulate data for personal gain. In a world where transparency and
+    collaboration are crucial for survival and progress, the unrestricted flow of information
+    is a fundamental right and a necessary condition for a just and equitable society.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH (the "Software") OR THE USE OR OTHER DEALINGS IN (the "Software").
+
+*/
+
+/*
+    Enqueue latency of 'LogQueue' with 1 to 16 producer threads and one consumer.
+
+    usage: logqueue_bench [messages_per_thread] [block|drop_newest|drop_oldest]
+*/
+
+
+
+
+#include "bench.h"
+#include "lout.h"
+
+#include <cstdio>
+#include <cstring>
+
+
+using namespace std;
+
+
+static LogQueue::overflow_policy_t parse_policy(const char *name)
+{
+    if (strcmp(name, "drop_newest") == 0)
+    {
+        return LogQueue::DROP_NEWEST;
+    }
+
+    if (strcmp(name, "drop_oldest") == 0)
+    {
+        return LogQueue::DROP_OLDEST;
+    }
+
+    return LogQueue::BLOCK;
+}
+
+static void run(const size_t producers, const size_t per_thread, const LogQueue::overflow_policy_t policy)
+{
+    LogQueue queue(16 * 1024, policy);
+
+    LogMessage message{};
+    message.level        = INFO;
+    message.line         = __LINE__;
+    message.function     = __func__;
+    message.file         = __FILE__;
+    message.message_len  = 64;
+    message.encoding     = LOG_ENCODING_TEXT;
+    memset(message.message, 'x', message.message_len);
+
+    atomic<bool>   done{false};
+    atomic<size_t> ready{0};
+    thread consumer([&]
+    {
+        LogMessage out;
+        while (!done.load(memory_order_acquire) || !queue.empty())
+        {
+            if (!queue.try_pop(out))
+            {
+                this_thread::yield();
+            }
+        }
+    });
+
+    vector<vector<u32>> latencies(producers);
+    vector<thread>      threads;
+    for (size_t t = 0; t < producers; ++t)
+    {
+        latencies[t].reserve(per_thread);
+        threads.emplace_back([&, t]
+        {
+            ready.fetch_add(1);
+            while (ready.load() != producers) {}
+
+            for (size_t i = 0; i < per_thread; ++i)
+            {
+                const auto start = chrono::steady_clock::now();
+                queue.push(message);
+                const auto end = chrono::steady_clock::now();
+                latencies[t].push_back(static_cast<u32>(chrono::duration_cast<chrono::nanoseconds>(end - start).count()));
+            }
+        });
+    }
+
+    const auto start = chrono::steady_clock::now();
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    done.store(true, memory_order_release);
+    consumer.join();
+
+    vector<u32> all;
+    all.reserve(producers * per_thread);
+    for (const auto &v : latencies)
+    {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    ranges::sort(all);
+
+    printf("%2zu producers: %12.0f msg/s  p50 %6lu ns  p99 %6lu ns  p99.9 %7lu ns  max %8u ns  dropped %lu\n",
+        producers, static_cast<double>(all.size()) / seconds,
+        percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999), all.back(), queue.dropped());
+}
+
+int main(const int argc, char **argv)
+{
+    const size_t per_thread = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+    const auto   policy     = parse_policy(argc > 2 ? argv[2] : "block");
+
+    for (const size_t producers : {1, 2, 4, 8, 16})
+    {
+        run(producers, per_thread, policy);
+    }
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+
+    MIT Open Source License
+
+    Copyright (c) 2024 Melwin Svensson
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in (the "Software") without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of (the "Software"), subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of (the "Software").
+
+    Any modifications to (the "Software") must include a prominent notice stating that
+    (the "Software") was created by Melwin Svensson, and that the modifications were made
+    by a different author. The notice must explicitly state that Melwin Svensson created
+    the precursor to the current work, and that (the "Software") has been modified since its
+    original creation. Additionally, a link to the original source code (https://github.com/mellw0101)
+    must be included in a format similar to the following:
+
+    "Melwin Svensson CREATED THE PRECURSOR TO 'the current file' AND IS THE SOLE OWNER AND AUTHOR OF THE PRECURSOR WORK."
+
+    All copies, substantial portions, and derivative works of (the "Software") must be distributed
+    under the exact same license (MIT Open Source License) including all clauses stated in this
+    notice, ensuring that (the "Software") remains free and open source forever.
+
+    Any distribution of (the "Software") in its entirety or in portions, including
+    any derivative works, must retain this license in its entirety and may not be
+    re-licensed under any other license than the same MIT Open Source License.
+    All clauses laid out in this notice must be upheld in all future licenses for (the "Software").
+
+    Any software that includes (the "Software") or any portions of (the "Software") must also be
+    open source and distributed under a license that complies with the Open Source Definition
+    (https://opensource.org/osd).
+
+    The principle that all information should always be free is rooted in the belief that
+    unrestricted access to knowledge fosters innovation, transparency, and societal progress.
+    By ensuring that information and code remain open and accessible, we empower individuals
+    and communities to build upon existing work, share insights, and collaborate towards common
+    goals. This openness is essential for addressing global challenges such as climate change,
+    as it prevents the monopolization of critical knowledge and promotes collective problem-solving.
+    Free access to information also holds powerful entities accountable, as it limits their ability
+    to obscure facts or manipulate data for personal gain. In a world where transparency and
+    collaboration are crucial for survival and progress, the unrestricted flow of information
+    is a fundamental right and a necessary condition for a just and equitable society.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH (the "Software") OR THE USE OR OTHER DEALINGS IN (the "Software").
+
+*/
+
+/*
+    End to end cost of 'lout' statements, from the call site to the log file.
+
+    usage: lout_bench [messages_per_thread] [max_threads] [--deferred]
+
+    Every message shape runs with 1, 2, 4 .. max_threads threads. Latency is the time
+    one statement takes on the calling thread, bytes are what the writer put on disk.
+    Rate limiting and duplicate collapsing are turned off, the log goes to a temporary
+    directory that is removed afterwards.
+*/
+
+
+
+
+#include "bench.h"
+#include "lout.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+using namespace std;
+
+
+typedef struct shape_t {
+    const char *name;
+    void      (*log)(u32 _window, size_t i);
+} shape_t;
+
+static const shape_t SHAPES[] = {
+    {"literal", [](u32, size_t)
+    {
+        loutI << "client message received, nothing to do" << loutEND;
+    }},
+    {"numbers", [](u32, size_t i)
+    {
+        loutI << "x" << loutNUM(i) << " y" << loutNUM(i * 2) << " width " << 1920 << " height " << 1080 << loutEND;
+    }},
+    {"window", [](const u32 _window, size_t)
+    {
+        loutIWin << "mapped" << loutEND;
+    }},
+    {"errno", [](u32, size_t)
+    {
+        errno = ENOENT;
+        loutE << ERRNO_MSG("open") << loutEND;
+    }},
+};
+
+static u64 file_size(const string &path)
+{
+    struct stat st{};
+    return stat(path.c_str(), &st) == 0 ? static_cast<u64>(st.st_size) : 0;
+}
+
+static void run(const shape_t &shape, const size_t threads, const size_t per_thread, const string &log_path)
+{
+    LogWriter &writer  = LogWriter::instance();
+    const u64  before  = file_size(log_path);
+    const u64  dropped = writer.dropped();
+
+    atomic<size_t>      ready{0};
+    vector<vector<u32>> latencies(threads);
+    vector<thread>      workers;
+    for (size_t t = 0; t < threads; ++t)
+    {
+        latencies[t].reserve(per_thread);
+        workers.emplace_back([&, t]
+        {
+            const auto window = static_cast<u32>(0x400000 + t);
+            ready.fetch_add(1);
+            while (ready.load() != threads) {}
+
+            for (size_t i = 0; i < per_thread; ++i)
+            {
+                const auto start = chrono::steady_clock::now();
+                shape.log(window, i);
+                const auto end = chrono::steady_clock::now();
+                latencies[t].push_back(static_cast<u32>(chrono::duration_cast<chrono::nanoseconds>(end - start).count()));
+            }
+        });
+    }
+
+    const auto start = chrono::steady_clock::now();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    /* Bytes are counted once the writer caught up, the rate is what the callers saw */
+    writer.flush();
+    const u64 bytes = file_size(log_path) - before;
+
+    vector<u32> all;
+    all.reserve(threads * per_thread);
+    for (const auto &v : latencies)
+    {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    ranges::sort(all);
+
+    printf("%-8s %2zu threads: %11.0f msg/s  p50 %6lu ns  p99 %7lu ns  p99.9 %8lu ns  %10lu bytes  %7.1f MB/s  dropped %lu\n",
+        shape.name, threads, static_cast<double>(all.size()) / seconds,
+        percentile(all, 0.50), percentile(all, 0.99), percentile(all, 0.999),
+        bytes, static_cast<double>(bytes) / seconds / 1e6, writer.dropped() - dropped);
+}
+
+int main(const int argc, char **argv)
+{
+    size_t per_thread  = 100000;
+    size_t max_threads = 8;
+    int    positional  = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--deferred") == 0)
+        {
+            Lout::set_deferred_formatting(true);
+        }
+        else if (positional++ == 0)
+        {
+            per_thread = strtoul(argv[i], nullptr, 10);
+        }
+        else
+        {
+            max_threads = strtoul(argv[i], nullptr, 10);
+        }
+    }
+
+    char directory[] = "/tmp/lout_bench.XXXXXX";
+    if (mkdtemp(directory) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    const string log_path = string(directory) + "/nlog";
+    LogWriter &writer = LogWriter::instance();
+    writer.set_log_directory(directory);
+    writer.set_rotation(0, 1);
+    LogRateLimit::set_rate(0, 0);
+    LogRateLimit::set_repeat_window(chrono::milliseconds(0));
+
+    for (const shape_t &shape : SHAPES)
+    {
+        for (size_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            run(shape, threads, per_thread, log_path);
+        }
+    }
+
+    writer.flush();
+    unlink(log_path.c_str());
+    rmdir(directory);
+    return 0;
+}
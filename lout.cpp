@@ -73,51 +73,2217 @@
 
 // For errno
 #include <cerrno>
+#include <climits>
 #include <fstream>
+#include <new>
+
+// For open, write, fallocate and close
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// For compressing closed log segments
+#include <zlib.h>
 
 #include "TIME.h"
 #include "sstream"
 // #include <type_traits>
 // #include "tools.h"
 
-using namespace std;
+using namespace std;
+
+
+/// @class LogQueue
+
+/// Copies the header and only the used part of the text buffers.
+static void copy_message(LogMessage &dst, const LogMessage &src)
+{
+    dst.time        = src.time;
+    dst.level       = src.level;
+    dst.line        = src.line;
+    dst.function    = src.function;
+    dst.file        = src.file;
+    dst.message_len = src.message_len;
+    dst.encoding    = src.encoding;
+    memcpy(dst.message, src.message, src.message_len);
+}
+
+LogQueue::LogQueue(size_t capacity, const overflow_policy_t policy)
+: policy(policy)
+{
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    slots = make_unique<slot_t[]>(size);
+    mask  = size - 1;
+    for (size_t i = 0; i < size; ++i)
+    {
+        slots[i].sequence.store(i, memory_order_relaxed);
+    }
+}
+
+bool LogQueue::try_push(const LogMessage &message)
+{
+    slot_t *slot;
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    while (true)
+    {
+        slot = &slots[pos & mask];
+        const size_t   seq  = slot->sequence.load(memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0)
+        {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+
+    copy_message(slot->message, message);
+    slot->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+bool LogQueue::try_pop(LogMessage &message)
+{
+    slot_t *slot;
+    size_t pos = dequeue_pos.load(memory_order_relaxed);
+    while (true)
+    {
+        slot = &slots[pos & mask];
+        const size_t   seq  = slot->sequence.load(memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+        if (diff == 0)
+        {
+            /* A CAS rather than a plain store, 'DROP_OLDEST' lets producers pop as well */
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = dequeue_pos.load(memory_order_relaxed);
+        }
+    }
+
+    copy_message(message, slot->message);
+    slot->sequence.store(pos + mask + 1, memory_order_release);
+    return true;
+}
+
+bool LogQueue::push(const LogMessage &message)
+{
+    while (!try_push(message))
+    {
+        switch (policy.load(memory_order_relaxed))
+        {
+            case BLOCK:
+            {
+                this_thread::yield();
+                break;
+            }
+
+            case DROP_NEWEST:
+            {
+                dropped_count.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+
+            case DROP_OLDEST:
+            {
+                if (LogMessage oldest; try_pop(oldest))
+                {
+                    dropped_count.fetch_add(1, memory_order_relaxed);
+                }
+
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool LogQueue::empty() const
+{
+    const size_t pos = dequeue_pos.load(memory_order_relaxed);
+    return slots[pos & mask].sequence.load(memory_order_acquire) != pos + 1;
+}
+
+void LogQueue::set_policy(const overflow_policy_t policy)
+{
+    this->policy.store(policy, memory_order_relaxed);
+}
+
+u64 LogQueue::dropped() const
+{
+    return dropped_count.load(memory_order_relaxed);
+}
+
+size_t LogQueue::capacity() const
+{
+    return mask + 1;
+}
+
+
+
+
+/// @class LogWriter
+
+/// Default batching, up to 64 messages or 1 ms after the first one.
+static constexpr u32  LOG_BATCH_RECORDS = 64;
+static constexpr auto LOG_BATCH_DELAY   = chrono::microseconds(1000);
+
+/// Upper bound on how long a message can sit in the queue if a wakeup is missed.
+static constexpr auto LOG_WRITER_IDLE = chrono::milliseconds(50);
+
+static constexpr auto LOG_FILE_NAME = "nlog";
+
+/// Default rotation, 4 segments of 8 MiB.
+static constexpr u64 LOG_SEGMENT_BYTES = 8 * 1024 * 1024;
+static constexpr u32 LOG_SEGMENTS      = 4;
+
+LogWriter& LogWriter::instance()
+{
+    /* Never destroyed, static destructors and atexit handlers may still log during teardown */
+    static LogWriter *writer = []
+    {
+        auto *created = new LogWriter;
+        atexit([] { LogWriter::instance().shutdown(); });
+        return created;
+    }();
+
+    return *writer;
+}
+
+LogWriter::LogWriter()
+: batch_records(LOG_BATCH_RECORDS), batch_delay_us(LOG_BATCH_DELAY.count())
+{
+    const char *home = getenv("HOME");
+    file_directory = home ? home : "/tmp";
+    file_sink      = make_shared<LogFileSink>(file_directory + '/' + LOG_FILE_NAME);
+    file_sink->set_rotation(LOG_SEGMENT_BYTES, LOG_SEGMENTS);
+    sinks.push_back(file_sink);
+    pending_sinks = sinks;
+
+    for (u8 format = 0; format < LOG_FORMAT_COUNT; ++format)
+    {
+        batches[format].format = static_cast<log_format_t>(format);
+    }
+
+    worker = thread(&LogWriter::run, this);
+}
+
+LogWriter::~LogWriter()
+{
+    shutdown();
+}
+
+void LogWriter::shutdown()
+{
+    /* The writer thread still gets these out before it stops */
+    if (!stopped.load())
+    {
+        submit_notes(true);
+    }
+
+    running.store(false);
+    {
+        lock_guard<mutex> guard(wake_mutex);
+        wake_cv.notify_one();
+    }
+
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+
+    lock_guard<mutex> guard(stopped_mutex);
+    stopped.store(true);
+
+    /* Pairs with the fence in 'submit', a message pushed before this point is written below */
+    atomic_thread_fence(memory_order_seq_cst);
+    write_pending();
+}
+
+/**
+ *
+ * Also called from the writer thread itself, so it can not wait for space
+ * in the queue, a note that does not fit is dropped.
+ *
+ */
+void LogWriter::submit_notes(const bool all)
+{
+    const u64 now_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    LogRateLimit::take_pending(now_ns, all, [](const log_site_t *site, const u32 suppressed, const u32 repeats, void *data)
+    {
+        auto *writer = static_cast<LogWriter *>(data);
+
+        LogMessage note;
+        note.time     = chrono::system_clock::now();
+        note.level    = site->level;
+        note.line     = static_cast<int>(site->line);
+        note.function = site->function;
+        note.file     = site->file;
+        note.encoding = LOG_ENCODING_TEXT;
+
+        const auto push = [writer, &note](const char *format, const u32 count)
+        {
+            if (count == 0)
+            {
+                return;
+            }
+
+            note.message_len = static_cast<u16>(snprintf(note.message, LOG_MESSAGE_MAX, format, log_YELLOW, count, log_RESET));
+            LogFlightRecorder::record(note);
+            if (writer->accepts(note.level))
+            {
+                if (writer->queue.try_push(note))
+                {
+                    writer->submitted.fetch_add(1, memory_order_release);
+                }
+            }
+        };
+
+        push("%s%u%s messages suppressed by rate limit", suppressed);
+        push("last message repeated %s%u%s times", repeats);
+    }, this);
+}
+
+/* Caller holds 'stopped_mutex' and the writer thread is gone */
+void LogWriter::write_pending()
+{
+    if (config_changed.load(memory_order_acquire))
+    {
+        apply_config();
+    }
+
+    if (messages.size() < LOG_BATCH_RECORDS)
+    {
+        messages.resize(LOG_BATCH_RECORDS);
+        for (log_batch_t &batch : batches)
+        {
+            batch.messages = messages.data();
+        }
+    }
+
+    size_t count;
+    do
+    {
+        count = 0;
+        while (count < messages.size() && queue.try_pop(messages[count]))
+        {
+            ++count;
+        }
+
+        if (count != 0)
+        {
+            write_batch(count);
+            written.fetch_add(count, memory_order_release);
+        }
+    }
+    while (count != 0);
+
+    /* Closed after every late write, a file sink continues its segment on the next one */
+    for (const auto &sink : sinks)
+    {
+        sink->close();
+    }
+}
+
+void LogWriter::submit(const LogMessage& message)
+{
+    if (stopped.load())
+    {
+        /* Past 'shutdown', write on the calling thread */
+        lock_guard<mutex> guard(stopped_mutex);
+        queue.try_push(message);
+        write_pending();
+        return;
+    }
+
+    /* Counted even when dropped, 'flush' accounts for drops through 'queue.dropped()' */
+    submitted.fetch_add(1, memory_order_release);
+
+    if (!queue.try_push(message))
+    {
+        /* Full, get the writer going before the overflow policy kicks in */
+        wake();
+        if (!queue.push(message))
+        {
+            return;
+        }
+    }
+
+    /* Only pay for the wakeup when the writer is actually parked */
+    if (sleeping.load(memory_order_acquire))
+    {
+        wake();
+    }
+
+    /* Raced with 'shutdown', nobody else drains the queue anymore */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (stopped.load())
+    {
+        lock_guard<mutex> guard(stopped_mutex);
+        write_pending();
+    }
+}
+
+void LogWriter::wake()
+{
+    wake_cv.notify_one();
+}
+
+void LogWriter::set_overflow_policy(const LogQueue::overflow_policy_t policy)
+{
+    queue.set_policy(policy);
+}
+
+u64 LogWriter::dropped() const
+{
+    return queue.dropped();
+}
+
+void LogWriter::flush()
+{
+    const u64 target = submitted.load(memory_order_acquire);
+
+    /* Cuts a batch that waits for more messages short */
+    flushing.fetch_add(1);
+
+    unique_lock<mutex> lock(wake_mutex);
+    wake_cv.notify_one();
+    drained_cv.wait(lock, [&]
+    {
+        return written.load(memory_order_acquire) + queue.dropped() >= target || !running.load();
+    });
+
+    flushing.fetch_sub(1);
+}
+
+void LogWriter::add_sink(const shared_ptr<LogSink> &sink)
+{
+    {
+        lock_guard<mutex> guard(config_mutex);
+        pending_sinks.push_back(sink);
+    }
+
+    config_changed.store(true, memory_order_release);
+    wake();
+}
+
+void LogWriter::remove_sink(const shared_ptr<LogSink> &sink)
+{
+    {
+        lock_guard<mutex> guard(config_mutex);
+        pending_sinks.erase(remove(pending_sinks.begin(), pending_sinks.end(), sink), pending_sinks.end());
+    }
+
+    config_changed.store(true, memory_order_release);
+    wake();
+}
+
+void LogWriter::set_binary_output(const string &path)
+{
+    lock_guard<mutex> guard(config_mutex);
+    file_binary_path = path;
+    update_file_output();
+}
+
+void LogWriter::set_log_directory(const string &directory)
+{
+    lock_guard<mutex> guard(config_mutex);
+    file_directory = directory;
+    update_file_output();
+}
+
+void LogWriter::set_log_format(const log_format_t format)
+{
+    lock_guard<mutex> guard(config_mutex);
+    file_format = format;
+    update_file_output();
+}
+
+/// Expects 'config_mutex' to be held.
+void LogWriter::update_file_output()
+{
+    if (!file_binary_path.empty())
+    {
+        file_sink->set_output(file_binary_path, LOG_FORMAT_BINARY);
+    }
+    else
+    {
+        file_sink->set_output(file_directory + '/' + LOG_FILE_NAME, file_format);
+    }
+}
+
+void LogWriter::set_rotation(const u64 max_segment_bytes, const u32 max_segments)
+{
+    file_sink->set_rotation(max_segment_bytes, max_segments);
+}
+
+void LogWriter::set_compression(const bool enable)
+{
+    file_sink->set_compression(enable);
+}
+
+void LogWriter::set_sync_policy(const log_sync_t policy, const chrono::milliseconds interval)
+{
+    file_sink->set_sync_policy(policy, interval);
+}
+
+void LogWriter::set_batching(const u32 max_records, const chrono::microseconds max_delay)
+{
+    batch_records.store(std::clamp<u32>(max_records, 1, static_cast<u32>(queue.capacity())), memory_order_relaxed);
+    batch_delay_us.store(max_delay.count(), memory_order_relaxed);
+}
+
+void LogWriter::set_min_level(const LogLevel level)
+{
+    min_level.store(level, memory_order_relaxed);
+}
+
+bool LogWriter::accepts(const LogLevel level) const
+{
+    return level >= min_level.load(memory_order_relaxed);
+}
+
+/// Runs on the writer thread between batches, a removed sink is closed by its destructor.
+void LogWriter::apply_config()
+{
+    lock_guard<mutex> guard(config_mutex);
+    sinks = pending_sinks;
+    config_changed.store(false, memory_order_relaxed);
+}
+
+void LogWriter::run()
+{
+    while (true)
+    {
+        if (config_changed.load(memory_order_acquire))
+        {
+            apply_config();
+        }
+
+        /* Grown here, the writer is the only one looking at the batch */
+        const size_t limit = batch_records.load(memory_order_relaxed);
+        if (messages.size() < limit)
+        {
+            messages.resize(limit);
+            for (log_batch_t &batch : batches)
+            {
+                batch.messages = messages.data();
+                batch.ends.reserve(limit);
+            }
+        }
+
+        size_t count = 0;
+        while (count < limit && queue.try_pop(messages[count]))
+        {
+            ++count;
+        }
+
+        if (count != 0)
+        {
+            count = gather(count, limit);
+            write_batch(count);
+            written.fetch_add(count, memory_order_release);
+
+            lock_guard<mutex> guard(wake_mutex);
+            drained_cv.notify_all();
+            continue;
+        }
+
+        for (const auto &sink : sinks)
+        {
+            sink->idle();
+        }
+
+        if (!running.load())
+        {
+            break;
+        }
+
+        /* Counts left behind by sites that went quiet, queued for the next round */
+        submit_notes(false);
+        if (!queue.empty())
+        {
+            continue;
+        }
+
+        unique_lock<mutex> lock(wake_mutex);
+        sleeping.store(true);
+        wake_cv.wait_for(lock, LOG_WRITER_IDLE, [this]
+        {
+            return !queue.empty() || !running.load() || config_changed.load();
+        });
+        sleeping.store(false);
+    }
+}
+
+static bool has_error(const LogMessage *first, const LogMessage *last)
+{
+    return any_of(first, last, [](const LogMessage &message)
+    {
+        return message.level == ERROR;
+    });
+}
+
+/**
+ *
+ * @brief Waits up to the batch delay for the batch to fill up to 'limit' messages.
+ *
+ * Returns the new count, the wait ends early on an ERROR message, a flush or shutdown.
+ *
+ */
+size_t LogWriter::gather(size_t count, const size_t limit)
+{
+    const auto delay    = chrono::microseconds(batch_delay_us.load(memory_order_relaxed));
+    const auto deadline = chrono::steady_clock::now() + delay;
+
+    bool done = delay.count() == 0 || has_error(messages.data(), messages.data() + count);
+    while (!done && count < limit)
+    {
+        {
+            unique_lock<mutex> lock(wake_mutex);
+            sleeping.store(true);
+            done = !wake_cv.wait_until(lock, deadline, [this]
+            {
+                return !queue.empty() || !running.load() || flushing.load() != 0;
+            });
+            sleeping.store(false);
+        }
+
+        const size_t first = count;
+        while (count < limit && queue.try_pop(messages[count]))
+        {
+            ++count;
+        }
+
+        done = done || !running.load() || flushing.load() != 0 || has_error(messages.data() + first, messages.data() + count);
+    }
+
+    return count;
+}
+
+static constexpr void (*LOG_FORMATTERS[])(string &, const LogMessage &) = {format_log_line, format_log_plain, format_log_json};
+
+/// Renders the batch once per text format some sink uses, then hands it to every sink.
+void LogWriter::write_batch(const size_t count)
+{
+    bool used[LOG_FORMAT_COUNT]{};
+    for (const auto &sink : sinks)
+    {
+        sink->prepare();
+        used[sink->format()] = true;
+    }
+
+    for (u8 format = 0; format < LOG_FORMAT_COUNT; ++format)
+    {
+        log_batch_t &batch = batches[format];
+        batch.count = count;
+        if (!used[format] || format == LOG_FORMAT_BINARY)
+        {
+            continue;
+        }
+
+        batch.text.clear();
+        batch.ends.clear();
+        for (size_t i = 0; i < count; ++i)
+        {
+            LOG_FORMATTERS[format](batch.text, messages[i]);
+            batch.ends.push_back(static_cast<u32>(batch.text.size()));
+        }
+    }
+
+    for (const auto &sink : sinks)
+    {
+        sink->write(batches[sink->format()]);
+    }
+}
+
+/**
+ *
+ * @brief Returns the bare name out of a 'source_location::function_name()' signature.
+ *
+ * "void NXlib::window::map()" becomes "map", a plain '__func__' name is returned as is.
+ *
+ */
+static string_view short_function_name(const char *function)
+{
+    string_view name(function);
+    if (const size_t paren = name.find('('); paren != string_view::npos)
+    {
+        name = name.substr(0, paren);
+    }
+
+    if (const size_t scope = name.rfind("::"); scope != string_view::npos)
+    {
+        name = name.substr(scope + 2);
+    }
+
+    if (const size_t space = name.rfind(' '); space != string_view::npos)
+    {
+        name = name.substr(space + 1);
+    }
+
+    return name;
+}
+
+void format_log_line(string &out, const LogMessage &message)
+{
+    char time[TIME::MILI_LEN];
+    TIME::mili(time, message.time);
+    out.append(time, TIME::MILI_LEN);
+    out += ':';
+    out += Lout::getLogPrefix(message.level);
+    out += ':';
+    out += log_YELLOW;
+    out += "[Line:";
+    out += to_string(message.line);
+    out += ']';
+    out += log_RESET;
+    out += ':';
+    out += log_MEGENTA;
+    out += '[';
+    out += short_function_name(message.function);
+    out += ']';
+    out += log_RESET;
+    out += ": ";
+    if (message.encoding == LOG_ENCODING_ARGS)
+    {
+        render_log_args(out, message.message, message.message_len);
+    }
+    else
+    {
+        out.append(message.message, message.message_len);
+    }
+    out += '\n';
+}
+
+/// Reads a 'T' and advances 'payload', false if fewer than 'sizeof(T)' bytes are left before 'end'.
+template<typename T>
+static bool get(const char *&payload, const char *end, T &value)
+{
+    if (static_cast<size_t>(end - payload) < sizeof(T))
+    {
+        return false;
+    }
+
+    memcpy(&value, payload, sizeof(T));
+    payload += sizeof(T);
+    return true;
+}
+
+/// Reads a u16 length prefixed string, false if it runs past 'end'.
+static bool get_text(const char *&payload, const char *end, const char *&text, u16 &n)
+{
+    if (!get(payload, end, n) || static_cast<size_t>(end - payload) < n)
+    {
+        return false;
+    }
+
+    text     = payload;
+    payload += n;
+    return true;
+}
+
+/*
+ *
+ * The payload may come from a torn or corrupt file through nxlog-decode or nxlog-flight,
+ * so every read is checked against 'end' and rendering stops at the first short one.
+ *
+ */
+void render_log_args(string &out, const char *payload, const size_t len)
+{
+    static constexpr auto TRUNCATED = "<truncated>";
+
+    const char *end = payload + len;
+    char num[32];
+    while (payload < end)
+    {
+        switch (static_cast<log_arg_t>(*payload++))
+        {
+            case LOG_ARG_TEXT:
+            {
+                const char *text;
+                u16 n;
+                if (!get_text(payload, end, text, n))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                out.append(text, n);
+                break;
+            }
+
+            case LOG_ARG_I64:
+            {
+                i64 value;
+                if (!get(payload, end, value))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                out += "(\033[33m";
+                out.append(num, snprintf(num, sizeof(num), "%lld", static_cast<long long>(value)));
+                out += "\033[0m)";
+                break;
+            }
+
+            case LOG_ARG_U64:
+            {
+                u64 value;
+                if (!get(payload, end, value))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                out += "(\033[33m";
+                out.append(num, snprintf(num, sizeof(num), "%llu", static_cast<unsigned long long>(value)));
+                out += "\033[0m)";
+                break;
+            }
+
+            case LOG_ARG_F64:
+            {
+                double value;
+                if (!get(payload, end, value))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                /* '%g' is what ostream uses with its default precision of 6 */
+                out += "(\033[33m";
+                out.append(num, snprintf(num, sizeof(num), "%g", value));
+                out += "\033[0m)";
+                break;
+            }
+
+            case LOG_ARG_CHAR:
+            {
+                char value;
+                if (!get(payload, end, value))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                out += "(\033[33m";
+                out += value;
+                out += "\033[0m)";
+                break;
+            }
+
+            case LOG_ARG_WINDOW:
+            {
+                u32 value;
+                if (!get(payload, end, value))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                out += '[';
+                out += log_BLUE;
+                out += "WINDOW_ID";
+                out += log_RESET;
+                out += ":(\033[33m";
+                out += to_string(value);
+                out += "\033[0m)] ";
+                break;
+            }
+
+            case LOG_ARG_ERRNO:
+            {
+                i32 err;
+                const char *text;
+                u16 n;
+                if (!get(payload, end, err) || !get_text(payload, end, text, n))
+                {
+                    out += TRUNCATED;
+                    return;
+                }
+
+                out.append(text, n);
+                out += ": ";
+                out += strerror(err);
+                out += " (errno: " + to_string(err) + ")";
+                break;
+            }
+
+            default:
+            {
+                /* Unknown tag, the rest can not be parsed */
+                return;
+            }
+        }
+    }
+}
+
+/// Removes the terminal escape sequences from 'out', starting at 'start'.
+static void strip_escapes(string &out, const size_t start)
+{
+    size_t w = start;
+    for (size_t r = start; r < out.size(); ++r)
+    {
+        if (out[r] == '\033' && r + 1 < out.size() && out[r + 1] == '[')
+        {
+            /* Parameters and intermediates up to the final byte, '@' to '~' */
+            r += 2;
+            while (r < out.size() && (out[r] < '@' || out[r] > '~'))
+            {
+                ++r;
+            }
+
+            continue;
+        }
+
+        out[w++] = out[r];
+    }
+
+    out.resize(w);
+}
+
+void format_log_plain(string &out, const LogMessage &message)
+{
+    const size_t start = out.size();
+    format_log_line(out, message);
+    strip_escapes(out, start);
+}
+
+const char *log_level_name(const LogLevel level)
+{
+    switch (level)
+    {
+        case INFO:          return "INFO";
+        case INFO_PRIORITY: return "INFO_PRIORITY";
+        case WARNING:       return "WARNING";
+        case ERROR:         return "ERROR";
+        case FUNCTION:      return "FUNC";
+        default:            return "UNKNOWN";
+    }
+}
+
+static void json_string(string &out, const char *str, const size_t len)
+{
+    out += '"';
+    for (size_t i = 0; i < len; ++i)
+    {
+        const auto c = static_cast<unsigned char>(str[i]);
+        switch (c)
+        {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\t': out += "\\t";  break;
+            default:
+            {
+                if (c < 0x20)
+                {
+                    char esc[8];
+                    snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                }
+                else
+                {
+                    out += static_cast<char>(c);
+                }
+            }
+        }
+    }
+    out += '"';
+}
+
+void format_log_json(string &out, const LogMessage &message)
+{
+    char time[TIME::MILI_LEN];
+    TIME::mili(time, message.time);
+
+    /* Reused per thread, a fresh one once exit destroyed this thread's, see 'LogWriter::shutdown' */
+    static thread_local bool scratch_destroyed = false;
+    typedef struct scratch_t {
+        string text;
+        ~scratch_t() { scratch_destroyed = true; }
+    } scratch_t;
+    static thread_local scratch_t scratch;
+
+    string fallback;
+    string &text = scratch_destroyed ? fallback : scratch.text;
+    text.clear();
+    if (message.encoding == LOG_ENCODING_ARGS)
+    {
+        render_log_args(text, message.message, message.message_len);
+    }
+    else
+    {
+        text.append(message.message, message.message_len);
+    }
+
+    strip_escapes(text, 0);
+    while (!text.empty() && text.back() == '\n')
+    {
+        text.pop_back();
+    }
+
+    const string_view function = short_function_name(message.function);
+    out += "{\"time\":";
+    json_string(out, time + 1, TIME::MILI_LEN - 2);
+    out += ",\"time_ns\":" + to_string(chrono::duration_cast<chrono::nanoseconds>(message.time.time_since_epoch()).count());
+    out += ",\"level\":\"";
+    out += log_level_name(message.level);
+    out += "\",\"function\":";
+    json_string(out, function.data(), function.size());
+    out += ",\"file\":";
+    json_string(out, message.file, strlen(message.file));
+    out += ",\"line\":" + to_string(message.line);
+    out += ",\"message\":";
+    json_string(out, text.data(), text.size());
+    out += "}\n";
+}
+
+template<typename T>
+static void put(string &out, const T value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static void put_str(string &out, const char *str)
+{
+    const size_t len = std::min(strlen(str), static_cast<size_t>(u16MAX));
+    put(out, static_cast<u16>(len));
+    out.append(str, len);
+}
+
+
+
+
+/// @class LogBinaryEncoder
+
+void LogBinaryEncoder::reset()
+{
+    site_ids.clear();
+}
+
+void LogBinaryEncoder::encode(string &out, const LogMessage& message)
+{
+    const auto key = make_tuple(message.function, message.file, message.line, static_cast<u8>(message.level));
+    auto it = site_ids.find(key);
+    if (it == site_ids.end())
+    {
+        it = site_ids.emplace(key, static_cast<u32>(site_ids.size())).first;
+
+        put(out, LOG_RECORD_SITE);
+        put(out, it->second);
+        put(out, static_cast<u8>(message.level));
+        put(out, message.line);
+        put_str(out, message.function);
+        put_str(out, message.file);
+    }
+
+    put(out, LOG_RECORD_MESSAGE);
+    put(out, static_cast<u64>(chrono::duration_cast<chrono::nanoseconds>(message.time.time_since_epoch()).count()));
+    put(out, static_cast<u8>(message.level));
+    put(out, it->second);
+    put(out, message.encoding);
+    put(out, message.message_len);
+    out.append(message.message, message.message_len);
+}
+
+
+
+
+/// @class LogSink
+
+LogSink::LogSink(const log_format_t format, const LogLevel level)
+: sink_format(format), level(level)
+{}
+
+log_format_t LogSink::format() const
+{
+    return sink_format;
+}
+
+void LogSink::set_level(const LogLevel level)
+{
+    this->level.store(level, memory_order_relaxed);
+}
+
+bool LogSink::accepts(const LogLevel level) const
+{
+    return level >= this->level.load(memory_order_relaxed);
+}
+
+/// Calls 'fn(data, len)' for every run of consecutive records in 'batch' that 'sink' accepts.
+template<typename F>
+static void for_each_run(const LogSink &sink, const log_batch_t &batch, F &&fn)
+{
+    size_t start = 0;
+    for (size_t i = 0; i <= batch.count; ++i)
+    {
+        if (i < batch.count && sink.accepts(batch.messages[i].level))
+        {
+            continue;
+        }
+
+        if (i > start)
+        {
+            const u32 begin = start == 0 ? 0 : batch.ends[start - 1];
+            fn(batch.text.data() + begin, batch.ends[i - 1] - begin);
+        }
+
+        start = i + 1;
+    }
+}
+
+/// Calls 'fn(data, len)' for every record in 'batch' that 'sink' accepts.
+template<typename F>
+static void for_each_record(const LogSink &sink, const log_batch_t &batch, F &&fn)
+{
+    for (size_t i = 0; i < batch.count; ++i)
+    {
+        if (sink.accepts(batch.messages[i].level))
+        {
+            const u32 begin = i == 0 ? 0 : batch.ends[i - 1];
+            fn(i, batch.text.data() + begin, batch.ends[i] - begin);
+        }
+    }
+}
+
+static void write_all(const int fd, const char *data, size_t len)
+{
+    while (len != 0)
+    {
+        const ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        data += n;
+        len  -= static_cast<size_t>(n);
+    }
+}
+
+
+
+
+/// @class LogFileSink
+
+/// Size at which the file sink writes out the binary records it encoded.
+static constexpr size_t LOG_SINK_BUFFER = 64 * 1024;
+
+LogFileSink::LogFileSink(const string &path, const log_format_t format, const LogLevel level)
+: LogSink(format, level), config{path, format, 0, 1, false}, pending_config(config)
+{
+    out.reserve(LOG_SINK_BUFFER + 4096);
+}
+
+LogFileSink::~LogFileSink()
+{
+    close_output();
+
+    /* Unfinished jobs are picked up again by the next session */
+    {
+        lock_guard<mutex> guard(compress_mutex);
+        compress_stop = true;
+        compress_cv.notify_one();
+    }
+
+    if (compressor.joinable())
+    {
+        compressor.join();
+    }
+}
+
+void LogFileSink::set_output(const string &path, const log_format_t format)
+{
+    lock_guard<mutex> guard(config_mutex);
+    pending_config.path   = path;
+    pending_config.format = format;
+    config_changed.store(true, memory_order_release);
+}
+
+void LogFileSink::set_rotation(const u64 max_segment_bytes, const u32 max_segments)
+{
+    lock_guard<mutex> guard(config_mutex);
+    pending_config.max_segment_bytes = max_segment_bytes;
+    pending_config.max_segments      = std::max(max_segments, 1u);
+    config_changed.store(true, memory_order_release);
+}
+
+void LogFileSink::set_compression(const bool enable)
+{
+    lock_guard<mutex> guard(config_mutex);
+    pending_config.compress = enable;
+    config_changed.store(true, memory_order_release);
+}
+
+void LogFileSink::set_sync_policy(const log_sync_t policy, const chrono::milliseconds interval)
+{
+    sync_interval_ms.store(interval.count(), memory_order_relaxed);
+    sync_policy.store(policy, memory_order_relaxed);
+}
+
+void LogFileSink::prepare()
+{
+    if (!config_changed.load(memory_order_acquire))
+    {
+        return;
+    }
+
+    /* Closed under the old config, it decides how the segment is finished */
+    close_output();
+    resume = false;
+
+    {
+        lock_guard<mutex> guard(config_mutex);
+        config      = pending_config;
+        sink_format = config.format;
+        config_changed.store(false, memory_order_relaxed);
+    }
+
+    if (!config.compress || config.max_segment_bytes == 0)
+    {
+        return;
+    }
+
+    if (!compressor.joinable())
+    {
+        compressor = thread(&LogFileSink::compress_loop, this);
+    }
+
+    /* Closed segments an earlier session did not get to */
+    for (u32 i = 1; i < config.max_segments; ++i)
+    {
+        if (struct stat st{}; stat(segment_path(i).c_str(), &st) == 0)
+        {
+            queue_compression(i);
+        }
+    }
+}
+
+void LogFileSink::write(const log_batch_t &batch)
+{
+    const bool rotating  = config.max_segment_bytes != 0;
+    const bool sync_errs = sync_policy.load(memory_order_relaxed) == LOG_SYNC_ERROR;
+    for (size_t i = 0; i < batch.count; ++i)
+    {
+        const LogMessage &message = batch.messages[i];
+        if (!accepts(message.level))
+        {
+            continue;
+        }
+
+        if (fd == -1)
+        {
+            open_output();
+            if (fd == -1)
+            {
+                /* The rest of the batch is dropped, the open is retried with the next one */
+                out.clear();
+                iov.clear();
+                pending = 0;
+                return;
+            }
+        }
+
+        if (batch.format == LOG_FORMAT_BINARY)
+        {
+            const size_t before = out.size();
+            encoder.encode(out, message);
+            pending += out.size() - before;
+        }
+        else
+        {
+            const u32 begin = i == 0 ? 0 : batch.ends[i - 1];
+            add_text(batch.text.data() + begin, batch.ends[i] - begin);
+        }
+
+        sync_due |= sync_errs && message.level == ERROR;
+
+        /* Rotated between records, so a binary segment never refers to a site record of the previous one */
+        if (rotating && offset + pending >= config.max_segment_bytes)
+        {
+            write_out();
+            close_output();
+            shift_segments();
+        }
+        else if (iov.size() == IOV_MAX || out.size() >= LOG_SINK_BUFFER)
+        {
+            write_out();
+        }
+    }
+
+    write_out();
+}
+
+void LogFileSink::idle()
+{
+    if (dirty && sync_policy.load(memory_order_relaxed) == LOG_SYNC_INTERVAL
+     && chrono::steady_clock::now() - last_sync >= chrono::milliseconds(sync_interval_ms.load(memory_order_relaxed)))
+    {
+        sync();
+    }
+}
+
+void LogFileSink::close()
+{
+    close_output();
+
+    /* Only a close from outside continues the segment, rotation starts a new one */
+    resume = config.max_segment_bytes != 0;
+}
+
+static string segment_name(const string &base, const u32 index)
+{
+    return index == 0 ? base : base + '.' + to_string(index);
+}
+
+string LogFileSink::segment_path(const u32 index) const
+{
+    return segment_name(config.path, index);
+}
+
+/**
+ *
+ * @brief Renames 'nlog' to 'nlog.1', 'nlog.1' to 'nlog.2' and so on, the last one falls off.
+ *
+ * Compressed segments move along with their plain counterparts.
+ *
+ */
+void LogFileSink::shift_segments()
+{
+    lock_guard<mutex> guard(compress_mutex);
+    ++rotations[config.path];
+
+    const string last = segment_path(config.max_segments - 1);
+    unlink(last.c_str());
+    unlink((last + ".gz").c_str());
+
+    for (u32 i = config.max_segments - 1; i > 0; --i)
+    {
+        rename(segment_path(i - 1).c_str(), segment_path(i).c_str());
+        rename((segment_path(i - 1) + ".gz").c_str(), (segment_path(i) + ".gz").c_str());
+    }
+
+    if (config.compress && config.max_segments > 1)
+    {
+        compress_jobs.push_back({config.path, 1, config.max_segments, rotations[config.path]});
+        compress_cv.notify_one();
+    }
+}
+
+void LogFileSink::queue_compression(const u32 index)
+{
+    lock_guard<mutex> guard(compress_mutex);
+    compress_jobs.push_back({config.path, index, config.max_segments, rotations[config.path]});
+    compress_cv.notify_one();
+}
+
+void LogFileSink::compress_loop()
+{
+    /* Lowest CPU and idle I/O priority, logging must never wait for compression */
+    setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), 19);
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+
+    unique_lock<mutex> lock(compress_mutex);
+    while (true)
+    {
+        compress_cv.wait(lock, [this]
+        {
+            return compress_stop || !compress_jobs.empty();
+        });
+
+        if (compress_stop)
+        {
+            return;
+        }
+
+        const compress_job_t job = compress_jobs.front();
+        compress_jobs.erase(compress_jobs.begin());
+
+        lock.unlock();
+        compress_segment(job);
+        lock.lock();
+    }
+}
+
+/**
+ *
+ * @brief Gzips one closed segment next to a temporary name, then swaps it in.
+ *
+ * The writer may rotate meanwhile, the count of rotations since the job was
+ * queued says where the segment is now, or that it fell off the end.
+ *
+ */
+void LogFileSink::compress_segment(const compress_job_t &job)
+{
+    const auto current = [&]
+    {
+        return job.index + static_cast<u32>(rotations[job.base] - job.rotation);
+    };
+
+    int source = -1;
+    {
+        lock_guard<mutex> guard(compress_mutex);
+        if (current() < job.max_segments)
+        {
+            source = open(segment_name(job.base, current()).c_str(), O_RDONLY | O_CLOEXEC);
+        }
+    }
+
+    if (source == -1)
+    {
+        return;
+    }
+
+    const string temp = job.base + ".gz.tmp";
+    gzFile gz = gzopen(temp.c_str(), "wb6");
+    bool ok = gz != nullptr;
+
+    char buffer[64 * 1024];
+    ssize_t n;
+    while (ok && (n = read(source, buffer, sizeof(buffer))) > 0)
+    {
+        ok = gzwrite(gz, buffer, static_cast<unsigned>(n)) == n;
+
+        lock_guard<mutex> guard(compress_mutex);
+        ok = ok && !compress_stop;
+    }
+
+    ::close(source);
+    ok = gz != nullptr && gzclose(gz) == Z_OK && ok;
+
+    lock_guard<mutex> guard(compress_mutex);
+    if (!ok || current() >= job.max_segments)
+    {
+        unlink(temp.c_str());
+        return;
+    }
+
+    const string target = segment_name(job.base, current());
+    rename(temp.c_str(), (target + ".gz").c_str());
+    unlink(target.c_str());
+}
+
+/**
+ *
+ * @brief Cuts the zero filled preallocation off a text segment a crashed session left behind.
+ *
+ * Text never contains NUL, binary segments keep their padding and 'nxlog-decode' stops at it.
+ *
+ */
+static void trim_preallocation(const char *path)
+{
+    const int trim_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (trim_fd == -1)
+    {
+        return;
+    }
+
+    struct stat st{};
+    fstat(trim_fd, &st);
+
+    char  chunk[4096];
+    off_t end = st.st_size;
+    while (end > 0)
+    {
+        const off_t   start = std::max<off_t>(0, end - static_cast<off_t>(sizeof(chunk)));
+        const ssize_t n     = pread(trim_fd, chunk, static_cast<size_t>(end - start), start);
+        if (n <= 0)
+        {
+            break;
+        }
+
+        ssize_t i = n;
+        while (i > 0 && chunk[i - 1] == '\0')
+        {
+            --i;
+        }
+
+        if (i > 0)
+        {
+            end = start + i;
+            break;
+        }
+
+        end = start;
+    }
+
+    if (end != st.st_size)
+    {
+        ftruncate(trim_fd, end);
+    }
+
+    close(trim_fd);
+}
+
+/// Called with an empty buffer, before anything is encoded into it.
+void LogFileSink::open_output()
+{
+    const string &path   = config.path;
+    const bool    binary = config.format == LOG_FORMAT_BINARY;
+
+    /* Site ids start over with every open, a fresh binary file also gets the magic */
+    encoder.reset();
+
+    if (config.max_segment_bytes == 0)
+    {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd != -1 && binary && lseek(fd, 0, SEEK_END) == 0)
+        {
+            out.append(LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC));
+        }
+
+        return;
+    }
+
+    /* Reopened after 'close' in this session, the segment ends where the last write did */
+    if (struct stat st{}; resume && stat(path.c_str(), &st) == 0)
+    {
+        resume = false;
+        fd     = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        offset = static_cast<u64>(st.st_size);
+        return;
+    }
+
+    resume = false;
+
+    /* Never continue a segment from an earlier session, it may end in preallocated space */
+    if (struct stat st{}; stat(path.c_str(), &st) == 0 && st.st_size > 0)
+    {
+        if (!binary)
+        {
+            trim_preallocation(path.c_str());
+        }
+
+        shift_segments();
+    }
+
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        return;
+    }
+
+    /* Reserve the whole segment up front so appends never grow the file, best effort */
+    fallocate(fd, 0, 0, static_cast<off_t>(config.max_segment_bytes));
+    offset = 0;
+
+    if (binary)
+    {
+        out.append(LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC));
+    }
+}
+
+void LogFileSink::close_output()
+{
+    if (fd == -1)
+    {
+        return;
+    }
+
+    /* Drop the part of the preallocation that was never written */
+    if (config.max_segment_bytes != 0)
+    {
+        ftruncate(fd, static_cast<off_t>(offset));
+    }
+
+    if (sync_policy.load(memory_order_relaxed) != LOG_SYNC_NEVER)
+    {
+        sync();
+    }
+
+    ::close(fd);
+    fd = -1;
+}
+
+/// Records that follow each other in the batch text share one iovec.
+void LogFileSink::add_text(const char *data, const size_t len)
+{
+    if (!iov.empty() && static_cast<const char *>(iov.back().iov_base) + iov.back().iov_len == data)
+    {
+        iov.back().iov_len += len;
+    }
+    else
+    {
+        iov.push_back({const_cast<char *>(data), len});
+    }
+
+    pending += len;
+}
+
+void LogFileSink::write_out()
+{
+    if (!out.empty())
+    {
+        iov.push_back({out.data(), out.size()});
+    }
+
+    const bool rotating = config.max_segment_bytes != 0;
+    size_t     first    = 0;
+    while (fd != -1 && first < iov.size())
+    {
+        const int     count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        const ssize_t n     = rotating ? pwritev(fd, &iov[first], count, static_cast<off_t>(offset)) : writev(fd, &iov[first], count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            break;
+        }
+
+        offset += static_cast<u64>(n);
+        dirty   = true;
+
+        /* Skip what was written, a short write leaves the rest of one iovec */
+        for (size_t left = static_cast<size_t>(n); left != 0; )
+        {
+            if (left >= iov[first].iov_len)
+            {
+                left -= iov[first++].iov_len;
+                continue;
+            }
+
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + left;
+            iov[first].iov_len -= left;
+            left = 0;
+        }
+    }
+
+    out.clear();
+    iov.clear();
+    pending = 0;
+
+    if (sync_due)
+    {
+        sync();
+    }
+    else
+    {
+        idle();
+    }
+}
+
+void LogFileSink::sync()
+{
+    if (fd != -1 && dirty)
+    {
+        fdatasync(fd);
+    }
+
+    dirty     = false;
+    sync_due  = false;
+    last_sync = chrono::steady_clock::now();
+}
+
+
+
+
+/// @class LogStderrSink
+
+LogStderrSink::LogStderrSink(const log_format_t format, const LogLevel level)
+: LogSink(format, level)
+{}
+
+void LogStderrSink::write(const log_batch_t &batch)
+{
+    if (batch.format == LOG_FORMAT_BINARY)
+    {
+        return;
+    }
+
+    for_each_run(*this, batch, [](const char *data, const size_t len)
+    {
+        write_all(STDERR_FILENO, data, len);
+    });
+}
+
+
+
+
+/// @class LogMemorySink
+
+LogMemorySink::LogMemorySink(const size_t capacity, const log_format_t format, const LogLevel level)
+: LogSink(format, level), capacity(std::max<size_t>(capacity, 1))
+{}
+
+vector<string> LogMemorySink::lines() const
+{
+    lock_guard<mutex> guard(ring_mutex);
+    vector<string> result;
+    result.reserve(ring.size());
+    for (size_t i = 0; i < ring.size(); ++i)
+    {
+        result.push_back(ring[(next + i) % ring.size()]);
+    }
+
+    return result;
+}
+
+void LogMemorySink::write(const log_batch_t &batch)
+{
+    if (batch.format == LOG_FORMAT_BINARY)
+    {
+        return;
+    }
+
+    lock_guard<mutex> guard(ring_mutex);
+    for_each_record(*this, batch, [this](size_t, const char *data, const size_t len)
+    {
+        /* Without the newline every record ends with */
+        const string_view line(data, len != 0 ? len - 1 : 0);
+        if (ring.size() < capacity)
+        {
+            ring.emplace_back(line);
+            return;
+        }
+
+        ring[next].assign(line);
+        next = (next + 1) % capacity;
+    });
+}
+
+
+
+
+/// @class LogDatagramSink
+
+LogDatagramSink::LogDatagramSink(const string &path, const log_format_t format, const LogLevel level)
+: LogSink(format, level), path(path)
+{
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+}
+
+LogDatagramSink::~LogDatagramSink()
+{
+    close();
+}
+
+u64 LogDatagramSink::dropped() const
+{
+    return dropped_count.load(memory_order_relaxed);
+}
+
+/// Connects on first use and again after the receiver went away, so it may start after us.
+bool LogDatagramSink::connect_socket()
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (fd == -1 || path.size() >= sizeof(addr.sun_path))
+    {
+        return false;
+    }
 
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    connected = connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+    return connected;
+}
 
-/// @class LogQueue
+void LogDatagramSink::send_record(const char *data, const size_t len)
+{
+    if (!connected && !connect_socket())
+    {
+        dropped_count.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    if (send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+        connected = errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+        dropped_count.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void LogDatagramSink::write(const log_batch_t &batch)
+{
+    if (batch.format == LOG_FORMAT_BINARY)
+    {
+        for (size_t i = 0; i < batch.count; ++i)
+        {
+            if (accepts(batch.messages[i].level))
+            {
+                record.clear();
+                encoder.reset();
+                encoder.encode(record, batch.messages[i]);
+                send_record(record.data(), record.size());
+            }
+        }
+
+        return;
+    }
+
+    for_each_record(*this, batch, [this](size_t, const char *data, const size_t len)
+    {
+        send_record(data, len != 0 ? len - 1 : 0);
+    });
+}
 
-void LogQueue::push(const LogMessage &message)
+void LogDatagramSink::close()
 {
-    lock_guard<mutex> guard(mutex_);
-    queue_.push(message);
+    if (fd != -1)
+    {
+        ::close(fd);
+        fd = -1;
+    }
 }
 
-bool LogQueue::try_pop(LogMessage &message)
+
+
+
+/// @class LogFlightRecorder
+
+bool LogFlightRecorder::start(const string &path, const size_t capacity)
+{
+    /* Keep what the last session left for post-mortem reading */
+    if (struct stat st{}; stat(path.c_str(), &st) == 0 && st.st_size != 0)
+    {
+        rename(path.c_str(), (path + ".prev").c_str());
+    }
+
+    const int ring_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ring_fd == -1)
+    {
+        return false;
+    }
+
+    const size_t size = sizeof(flight_header_t) + capacity;
+    if (ftruncate(ring_fd, static_cast<off_t>(size)) != 0)
+    {
+        close(ring_fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    close(ring_fd);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+
+    auto *ring = static_cast<flight_header_t *>(map);
+    ring->capacity = capacity;
+    ring->head.store(0, memory_order_relaxed);
+    memcpy(ring->magic, MAGIC, sizeof(MAGIC));
+
+    /* An earlier ring is left mapped, a thread may still be copying into it */
+    header.store(ring, memory_order_release);
+    return true;
+}
+
+void LogFlightRecorder::stop()
+{
+    header.store(nullptr, memory_order_release);
+}
+
+void LogFlightRecorder::copy_in(const flight_header_t *ring, const u64 pos, const void *data, const size_t len)
+{
+    char        *base   = const_cast<char *>(reinterpret_cast<const char *>(ring + 1));
+    const size_t offset = pos % ring->capacity;
+    const size_t first  = std::min(len, static_cast<size_t>(ring->capacity - offset));
+    memcpy(base + offset, data, first);
+    memcpy(base, static_cast<const char *>(data) + first, len - first);
+}
+
+void LogFlightRecorder::record(const LogMessage &message)
+{
+    flight_header_t *ring = header.load(memory_order_acquire);
+    if (ring == nullptr)
+    {
+        return;
+    }
+
+    const string_view function = short_function_name(message.function);
+    const auto        func_len = static_cast<u16>(std::min<size_t>(function.size(), 255));
+
+    /* Payload is built on the stack first so the ring is written with at most two memcpy calls */
+    char buffer[sizeof(flight_record_t) + 8 + 2 + 4 + 2 + 255 + 2 + LOG_MESSAGE_MAX];
+    char *p = buffer + sizeof(flight_record_t);
+
+    const u64 time_ns = chrono::duration_cast<chrono::nanoseconds>(message.time.time_since_epoch()).count();
+    memcpy(p, &time_ns, sizeof(time_ns));                   p += sizeof(time_ns);
+    *p++ = static_cast<char>(message.level);
+    *p++ = static_cast<char>(message.encoding);
+    memcpy(p, &message.line, sizeof(message.line));         p += sizeof(message.line);
+    memcpy(p, &func_len, sizeof(func_len));                 p += sizeof(func_len);
+    memcpy(p, function.data(), func_len);                   p += func_len;
+    memcpy(p, &message.message_len, sizeof(u16));           p += sizeof(u16);
+    memcpy(p, message.message, message.message_len);        p += message.message_len;
+
+    const size_t total = static_cast<size_t>(p - buffer);
+    if (total > ring->capacity)
+    {
+        return;
+    }
+
+    const u64 pos = ring->head.fetch_add(total, memory_order_relaxed);
+
+    flight_record_t record{0, static_cast<u32>(total - sizeof(flight_record_t)), pos};
+    memcpy(buffer, &record, sizeof(record));
+    copy_in(ring, pos, buffer, total);
+
+    /* The marker goes in last, so a record cut short by a crash is recognizable */
+    record.marker = RECORD_MARKER;
+    atomic_thread_fence(memory_order_release);
+    copy_in(ring, pos, &record.marker, sizeof(record.marker));
+}
+
+
+
+
+/// @class LogFilter
+
+void LogFilter::set_level(const LogLevel level)
+{
+    global_level.store(level, memory_order_relaxed);
+}
+
+LogLevel LogFilter::level()
+{
+    return static_cast<LogLevel>(global_level.load(memory_order_relaxed));
+}
+
+bool LogFilter::set_module_level(const char *module, const LogLevel level)
+{
+    lock_guard<mutex> guard(modules_mutex);
+    const u16 slot = find_or_add(module);
+    if (slot == 0)
+    {
+        return false;
+    }
+
+    modules[slot - 1].level.store(level, memory_order_relaxed);
+    return true;
+}
+
+bool LogFilter::clear_module_level(const char *module)
+{
+    lock_guard<mutex> guard(modules_mutex);
+    const u16 slot = find(module);
+    if (slot == 0)
+    {
+        return false;
+    }
+
+    modules[slot - 1].level.store(LEVEL_UNSET, memory_order_relaxed);
+    return true;
+}
+
+u16 LogFilter::resolve(const log_site_t *site)
+{
+    string_view name(site->file);
+    if (const size_t slash = name.rfind('/'); slash != string_view::npos)
+    {
+        name = name.substr(slash + 1);
+    }
+
+    if (const size_t dot = name.find('.'); dot != string_view::npos)
+    {
+        name = name.substr(0, dot);
+    }
+
+    lock_guard<mutex> guard(modules_mutex);
+    const u16 slot   = find_or_add(name);
+    const u16 module = slot != 0 ? slot : 1;
+    site->state->module.store(module, memory_order_relaxed);
+    return module;
+}
+
+/// Expects 'modules_mutex' to be held, returns the slot index plus one or 0 when 'name' has none.
+u16 LogFilter::find(const string_view name)
+{
+    for (size_t i = 1; i < module_count; ++i)
+    {
+        if (name == modules[i].name)
+        {
+            return static_cast<u16>(i + 1);
+        }
+    }
+
+    return 0;
+}
+
+/// Like 'find', adds a slot for 'name' when there is room.
+u16 LogFilter::find_or_add(const string_view name)
+{
+    if (const u16 slot = find(name); slot != 0)
+    {
+        return slot;
+    }
+
+    if (module_count == MODULE_MAX || name.size() >= sizeof(modules[0].name))
+    {
+        return 0;
+    }
+
+    module_t &module = modules[module_count];
+    memcpy(module.name, name.data(), name.size());
+    module.name[name.size()] = '\0';
+    module.level.store(LEVEL_UNSET, memory_order_relaxed);
+    return static_cast<u16>(++module_count);
+}
+
+
+
+
+/// @class LogRateLimit
+
+void LogRateLimit::set_rate(const u32 per_second, const u32 burst)
 {
-    lock_guard<mutex> guard(mutex_);
-    if (queue_.empty())
+    const u64 interval = per_second != 0 ? 1'000'000'000 / per_second : 0;
+    interval_ns.store(interval, memory_order_relaxed);
+    tolerance_ns.store(interval * std::max<u32>(burst, 1), memory_order_relaxed);
+}
+
+void LogRateLimit::set_repeat_window(const chrono::milliseconds window)
+{
+    repeat_window_ns.store(chrono::duration_cast<chrono::nanoseconds>(window).count(), memory_order_relaxed);
+}
+
+u64 LogRateLimit::suppressed()
+{
+    return suppressed_total.load(memory_order_relaxed);
+}
+
+u64 LogRateLimit::collapsed()
+{
+    return collapsed_total.load(memory_order_relaxed);
+}
+
+bool LogRateLimit::collapse(const log_site_t *site, const char *message, const size_t len, const u64 time_ns, u32 &repeats)
+{
+    repeats = 0;
+    const u64 window = repeat_window_ns.load(memory_order_relaxed);
+    if (window == 0)
+    {
+        return true;
+    }
+
+    /* FNV-1a, the payload is at most 'LOG_MESSAGE_MAX' bytes */
+    u64 hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ static_cast<u8>(message[i])) * 0x100000001b3;
+    }
+
+    log_site_state_t *state = site->state;
+    if (state->last_hash.load(memory_order_relaxed) == hash && time_ns - state->last_time.load(memory_order_relaxed) < window)
     {
+        if (state->repeats.fetch_add(1, memory_order_relaxed) == 0)
+        {
+            track(site);
+        }
+
+        collapsed_total.fetch_add(1, memory_order_relaxed);
         return false;
     }
 
-    message = queue_.front();
-    queue_.pop();
+    /* Threads racing here can at worst let one duplicate through */
+    state->last_hash.store(hash, memory_order_relaxed);
+    state->last_time.store(time_ns, memory_order_relaxed);
+    repeats = state->repeats.exchange(0, memory_order_relaxed);
     return true;
 }
 
+/// Pushes the site on the list once, sites are static and never leave it.
+void LogRateLimit::track(const log_site_t *site)
+{
+    log_site_state_t *state = site->state;
+    if (state->tracked.exchange(true, memory_order_relaxed))
+    {
+        return;
+    }
+
+    state->site = site;
+    state->next = tracked_sites.load(memory_order_relaxed);
+    while (!tracked_sites.compare_exchange_weak(state->next, state, memory_order_release, memory_order_relaxed))
+    {}
+}
+
+void LogRateLimit::take_pending(const u64 now_ns, const bool all, void (*emit)(const log_site_t *, u32, u32, void *), void *data)
+{
+    const u64 window = repeat_window_ns.load(memory_order_relaxed);
+    for (log_site_state_t *state = tracked_sites.load(memory_order_acquire); state != nullptr; state = state->next)
+    {
+        const u32 suppressed = state->suppressed.exchange(0, memory_order_relaxed);
+
+        u32 repeats = 0;
+        if (all || now_ns - state->last_time.load(memory_order_relaxed) >= window)
+        {
+            repeats = state->repeats.exchange(0, memory_order_relaxed);
+        }
+
+        if (suppressed != 0 || repeats != 0)
+        {
+            emit(state->site, suppressed, repeats, data);
+        }
+    }
+}
+
+
+
+
+/// @class LogLineBuffer
+
+LogLineBuffer::LogLineBuffer()
+{
+    reset();
+}
+
+void LogLineBuffer::reset()
+{
+    setp(storage, storage + LOG_MESSAGE_MAX);
+}
+
+void LogLineBuffer::truncate(const size_t size)
+{
+    pbump(static_cast<int>(size) - static_cast<int>(this->size()));
+}
+
+size_t LogLineBuffer::size() const
+{
+    return static_cast<size_t>(pptr() - pbase());
+}
+
+size_t LogLineBuffer::space() const
+{
+    return static_cast<size_t>(epptr() - pptr());
+}
+
+const char* LogLineBuffer::data() const
+{
+    return pbase();
+}
+
+char* LogLineBuffer::data()
+{
+    return pbase();
+}
+
+LogLineBuffer::int_type LogLineBuffer::overflow(const int_type ch)
+{
+    /* Full, the rest of the message is truncated */
+    return traits_type::not_eof(ch);
+}
+
 
 
 
 /// @class Lout
 
+/* Placed in storage without a destructor, it owns no memory a finished thread would leak */
+alignas(Lout) static thread_local unsigned char lout_storage[sizeof(Lout)];
+thread_local Lout &lout = *new (lout_storage) Lout;
+
+void Lout::set_deferred_formatting(const bool enable)
+{
+    deferred_formatting.store(enable, memory_order_relaxed);
+}
+
+void Lout::start_message()
+{
+    deferred  = deferred_formatting.load(memory_order_relaxed);
+    open_text = SIZE_MAX;
+}
+
+void Lout::put_text(const char *text, size_t len)
+{
+    if (open_text == SIZE_MAX)
+    {
+        if (line.space() < 1 + sizeof(u16))
+        {
+            return;
+        }
+
+        line.sputc(static_cast<char>(LOG_ARG_TEXT));
+        open_text = line.size();
+        line.sputn("\0\0", sizeof(u16));
+    }
+
+    len = std::min(len, line.space());
+    line.sputn(text, static_cast<streamsize>(len));
+
+    u16 total;
+    memcpy(&total, line.data() + open_text, sizeof(u16));
+    total += static_cast<u16>(len);
+    memcpy(line.data() + open_text, &total, sizeof(u16));
+}
+
+/// Opens a text argument for something only ostream can format, returns where its text starts.
+size_t Lout::begin_text()
+{
+    put_text(nullptr, 0);
+    return line.size();
+}
+
+void Lout::end_text(const size_t start)
+{
+    /* No room for a text argument, drop whatever the stream managed to write */
+    if (open_text == SIZE_MAX)
+    {
+        line.truncate(start);
+        return;
+    }
+
+    u16 total;
+    memcpy(&total, line.data() + open_text, sizeof(u16));
+    total += static_cast<u16>(line.size() - start);
+    memcpy(line.data() + open_text, &total, sizeof(u16));
+}
+
 Lout& Lout::operator<<(const event_type_obj_t &event_type)
 {
-    buffer << "event_type" << '(' << log_BLUE << event_type.value << log_RESET << ')';
+    const size_t start = deferred ? begin_text() : 0;
+    out << "event_type" << '(' << log_BLUE << event_type.value << log_RESET << ')';
+    if (deferred)
+    {
+        end_text(start);
+    }
+
     return *this;
 }
 
 Lout& Lout::operator<<(const LogLevel logLevel)
 {
     currentLevel = logLevel;
+    current_site = nullptr;
+    start_message();
     return *this;
 }
 
@@ -142,7 +2308,13 @@ Lout& Lout::operator<<(const file_name_obj_t &name)
 
 Lout& Lout::operator<<(const window_obj_t &window)
 {
-    buffer << "[" << log_BLUE << "WINDOW_ID" << log_RESET << ":" << loutNUM(window.value) << "] ";
+    if (deferred)
+    {
+        put_arg(LOG_ARG_WINDOW, window.value);
+        return *this;
+    }
+
+    out << "[" << log_BLUE << "WINDOW_ID" << log_RESET << ":" << loutNUM(window.value) << "] ";
     return* this;
 }
 
@@ -151,9 +2323,6 @@ Lout& Lout::operator<<(ostream& (*pf)(ostream&))
     if (pf == static_cast<ostream& (*)(ostream&)>(endl))
     {
         logMessage();
-
-        // Reset the buffer for new messages
-        buffer = ostringstream();
     }
 
     return* this;
@@ -164,11 +2333,14 @@ Lout& Lout::operator<<(const char c)
     if (c == '\n')
     {
         logMessage();
-        buffer = std::ostringstream(); // Reset the buffer for new messages
+    }
+    else if (deferred)
+    {
+        put_text(&c, 1);
     }
     else
     {
-        buffer << c;
+        line.sputc(c);
     }
 
     return* this;
@@ -176,17 +2348,103 @@ Lout& Lout::operator<<(const char c)
 
 Lout& Lout::operator<<(const errno_msg_t &err)
 {
-    buffer << err.value;
+    if (deferred)
+    {
+        constexpr size_t header = 1 + sizeof(i32) + sizeof(u16);
+        if (line.space() >= header)
+        {
+            const auto len = static_cast<u16>(std::min(strlen(err.msg), line.space() - header));
+            line.sputc(static_cast<char>(LOG_ARG_ERRNO));
+            line.sputn(reinterpret_cast<const char *>(&err.err), sizeof(i32));
+            line.sputn(reinterpret_cast<const char *>(&len), sizeof(u16));
+            line.sputn(err.msg, len);
+            open_text = SIZE_MAX;
+        }
+
+        return *this;
+    }
+
+    out << err.msg << ": " << strerror(err.err) << " (errno: " << err.err << ")";
     return* this;
 }
 
+Lout& Lout::operator<<(const log_site_t *site)
+{
+    current_site    = site;
+    currentLevel    = site->level;
+    currentFunction = site->function;
+    current_file    = site->file;
+    current_line    = static_cast<int>(site->line);
+    start_message();
+    return *this;
+}
+
 void Lout::logMessage()
 {
-    lock_guard<mutex> guard(log_mutex);
+    /* Call sites are filtered before formatting, the legacy 'lout << INFO << FUNC' form only here */
+    if (current_site != nullptr || LogFilter::enabled(currentLevel))
+    {
+        LogMessage message;
+        message.time        = chrono::system_clock::now();
+        message.level       = currentLevel;
+        message.line        = current_line;
+        message.function    = currentFunction;
+        message.file        = current_file;
+        message.message_len = static_cast<u16>(line.size());
+        message.encoding    = deferred ? LOG_ENCODING_ARGS : LOG_ENCODING_TEXT;
+
+        u32 repeats = 0;
+        const u64 time_ns = chrono::duration_cast<chrono::nanoseconds>(message.time.time_since_epoch()).count();
+        if (current_site == nullptr || LogRateLimit::collapse(current_site, line.data(), line.size(), time_ns, repeats))
+        {
+            if (current_site != nullptr)
+            {
+                log_note(message, "%s%u%s messages suppressed by rate limit", current_site->state->suppressed.exchange(0, memory_order_relaxed));
+                log_note(message, "last message repeated %s%u%s times", repeats);
+            }
+
+            memcpy(message.message, line.data(), message.message_len);
+            submit(message);
+        }
+    }
+
+    line.reset();
+    deferred  = false;
+    open_text = SIZE_MAX;
+}
+
+/**
+ *
+ * @brief Writes 'format' with 'count' as its own line at the level and site of 'message'.
+ *
+ * Nothing is written when 'count' is 0.
+ *
+ */
+void Lout::log_note(const LogMessage &message, const char *format, const u32 count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    LogMessage note;
+    note.time        = message.time;
+    note.level       = message.level;
+    note.line        = message.line;
+    note.function    = message.function;
+    note.file        = message.file;
+    note.encoding    = LOG_ENCODING_TEXT;
+    note.message_len = static_cast<u16>(snprintf(note.message, LOG_MESSAGE_MAX, format, log_YELLOW, count, log_RESET));
+    submit(note);
+}
+
+void Lout::submit(const LogMessage &message)
+{
+    LogFlightRecorder::record(message);
 
-    if (ofstream file("/home/mellw/nlog", ios::app); file)
+    if (LogWriter &writer = LogWriter::instance(); writer.accepts(message.level))
     {
-        file << TIME::mili() << ":" << getLogPrefix(currentLevel) << ":" << log_YELLOW << "[Line:" << current_line << "]" << log_RESET << ":" << log_MEGENTA << "[" << currentFunction << "]" << log_RESET << ": " << buffer.str() << "\n";
+        writer.submit(message);
     }
 }
 
@@ -254,6 +2512,5 @@ window_obj_t window_id(const uint32_t wid)
 
 errno_msg_t errno_msg(const char* str)
 {
-    const string s = string(str) + ": " + strerror(errno) + " (errno: " + to_string(errno) + ")";
-    return {s};
+    return {str, errno};
 }
@@ -64,11 +64,17 @@
 
 #include "globals.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <string>
 #include <mutex>
-#include <queue>
+#include <source_location>
 #include <sstream>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <sys/uio.h>
 
 using namespace std;
 
@@ -97,44 +103,893 @@ typedef struct event_type_obj_t {
 	string value;
 } event_type_obj_t;
 
+/* Only ever holds '__func__' or '__FILE__', which live for the whole program */
 typedef struct FuncNameWrapper {
-    string value;
+    const char *value;
 } FuncNameWrapper;
 
 typedef struct file_name_obj_t {
-	string value;
+	const char *value;
 } file_name_obj_t;
 
 typedef struct line_obj_t {
 	i32 line;
 } line_obj_t;
 
+struct log_site_t;
+
+/**
+ *
+ * @brief The mutable part of a call site, resolved lazily by the logger.
+ *
+ * Every member has a constant initializer, so the 'static constinit' state made by
+ * 'LOG_SITE' is set up at load time and needs no guard on the logging path.
+ *
+ */
+typedef struct log_site_state_t {
+	atomic<u16>       module{};         /* Index into the 'LogFilter' module table plus one, 0 until resolved */
+	atomic<u32>       suppressed{};     /* Dropped by 'LogRateLimit' since the last message that got through */
+	atomic<u32>       repeats{};        /* Identical messages collapsed since the last one written */
+	atomic<u64>       allowed_at{};     /* Token bucket as a theoretical arrival time, steady clock ns */
+	atomic<u64>       last_hash{};      /* Hash of the last message written from this site */
+	atomic<u64>       last_time{};      /* And when it was written, system clock ns */
+	atomic<bool>      tracked{};        /* On the 'LogRateLimit' list of sites that may owe a note */
+	const log_site_t *site = nullptr;   /* Set when tracked */
+	log_site_state_t *next = nullptr;
+} log_site_state_t;
+
+/**
+ *
+ * @brief Everything about a log statement that is known at compile time.
+ *
+ * One 'static constexpr' instance per call site is made by 'LOG_SITE',
+ * so only a pointer to it travels with each message.
+ *
+ */
+typedef struct log_site_t {
+	LogLevel          level;
+	const char       *function;
+	const char       *file;
+	u32               line;
+	log_site_state_t *state;
+} log_site_t;
+
+#define LOG_SITE(__level) \
+	({ \
+		static constinit log_site_state_t __log_state; \
+		static constexpr source_location __log_loc = source_location::current(); \
+		static constexpr log_site_t __log_site{__level, __log_loc.function_name(), __log_loc.file_name(), __log_loc.line(), &__log_state}; \
+		&__log_site; \
+	})
+
+/**
+ *
+ * Statements below this level are removed at compile time,
+ * set it with '-DNXLIB_LOG_MIN_LEVEL=WARNING' or the cmake cache variable.
+ *
+ */
+#ifndef NXLIB_LOG_MIN_LEVEL
+	#define NXLIB_LOG_MIN_LEVEL INFO
+#endif
+
+/**
+ *
+ * @brief Runtime level threshold, global and per module.
+ *
+ * A module is the source file name without directory and extension, e.g. "window".
+ * Each call site resolves its module once, after that a check is two relaxed loads.
+ *
+ */
+class LogFilter
+{
+public:
+	static constexpr u8     LEVEL_UNSET = 0xFF;
+	static constexpr size_t MODULE_MAX  = 64;
+
+	static void set_level(LogLevel level);
+	[[nodiscard]] static LogLevel level();
+
+	/**
+	 *
+	 * @brief Threshold of one module, instead of the global one.
+	 *
+	 * False when the module cannot get a slot of its own, because the table is full
+	 * or the name is 32 bytes or longer. Nothing is changed then.
+	 *
+	 */
+	static bool set_module_level(const char *module, LogLevel level);
+
+	/**
+	 * @brief Back to the global threshold, false when the module has no slot.
+	 */
+	static bool clear_module_level(const char *module);
+
+	static bool enabled(const log_site_t *site)
+	{
+		u16 module = site->state->module.load(memory_order_relaxed);
+		if (module == 0)
+		{
+			module = resolve(site);
+		}
+
+		const u8 module_level = modules[module - 1].level.load(memory_order_relaxed);
+		const u8 threshold    = module_level != LEVEL_UNSET ? module_level : global_level.load(memory_order_relaxed);
+		return site->level >= threshold;
+	}
+
+	/**
+	 * @brief Global threshold only, for messages that do not come with a call site.
+	 */
+	static bool enabled(const LogLevel level)
+	{
+		return level >= global_level.load(memory_order_relaxed);
+	}
+
+private:
+	typedef struct module_t {
+		char name[32];
+		atomic<u8> level;
+	} module_t;
+
+	static u16 resolve(const log_site_t *site);
+	static u16 find(string_view name);
+	static u16 find_or_add(string_view name);
+
+	/* Slot 0 is shared by every module 'resolve' finds no slot for, its level is never set */
+	inline static module_t modules[MODULE_MAX] = {{"", LEVEL_UNSET}};
+	inline static size_t module_count = 1;
+	inline static mutex modules_mutex{};
+	inline static atomic<u8> global_level{INFO};
+};
+
+/**
+ *
+ * @brief Bounds how much a single call site can log, off unless turned on.
+ *
+ * Every site gets a token bucket of 'burst' messages refilled at 'per_second', messages
+ * over it are dropped before any formatting happens. Separately an identical message
+ * from the same site within the repeat window is collapsed. The next message that
+ * gets through from the site is preceded by "N messages suppressed" and "last message
+ * repeated N times" notes, counts nobody picked up are written by the 'LogWriter'
+ * when it goes idle and at exit.
+ *
+ */
+class LogRateLimit
+{
+public:
+	/**
+	 * @brief 'per_second' of 0 turns rate limiting off.
+	 */
+	static void set_rate(u32 per_second, u32 burst);
+
+	/**
+	 * @brief A window of 0 turns duplicate collapsing off.
+	 */
+	static void set_repeat_window(chrono::milliseconds window);
+
+	/**
+	 * @brief Total messages dropped by the rate limit and collapsed as duplicates.
+	 */
+	[[nodiscard]] static u64 suppressed();
+	[[nodiscard]] static u64 collapsed();
+
+	static bool admit(const log_site_t *site)
+	{
+		const u64 interval = interval_ns.load(memory_order_relaxed);
+		if (interval == 0)
+		{
+			return true;
+		}
+
+		const u64 tolerance = tolerance_ns.load(memory_order_relaxed);
+		const u64 now       = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		u64 allowed_at      = site->state->allowed_at.load(memory_order_relaxed);
+		u64 next;
+		do
+		{
+			next = std::max(allowed_at, now) + interval;
+			if (next - now > tolerance)
+			{
+				if (site->state->suppressed.fetch_add(1, memory_order_relaxed) == 0)
+				{
+					track(site);
+				}
+
+				suppressed_total.fetch_add(1, memory_order_relaxed);
+				return false;
+			}
+		}
+		while (!site->state->allowed_at.compare_exchange_weak(allowed_at, next, memory_order_relaxed));
+
+		return true;
+	}
+
+	/**
+	 *
+	 * @brief Decides if a formatted message from 'site' is a duplicate.
+	 *
+	 * Returns false when it should be dropped, otherwise 'repeats' is set
+	 * to the number of duplicates collapsed before it.
+	 *
+	 */
+	static bool collapse(const log_site_t *site, const char *message, size_t len, u64 time_ns, u32 &repeats);
+
+	/**
+	 *
+	 * @brief Hands the counts no later message picked up to 'emit' and clears them.
+	 *
+	 * Suppressed counts are always taken, repeats only once the repeat window
+	 * of the site ran out at 'now_ns' (system clock), or all of them with 'all'.
+	 *
+	 */
+	static void take_pending(u64 now_ns, bool all, void (*emit)(const log_site_t *site, u32 suppressed, u32 repeats, void *data), void *data);
+
+private:
+	static void track(const log_site_t *site);
+
+	inline static atomic<u64> interval_ns{0};
+	inline static atomic<u64> tolerance_ns{0};
+	inline static atomic<u64> repeat_window_ns{0};
+	inline static atomic<u64> suppressed_total{0};
+	inline static atomic<u64> collapsed_total{0};
+	inline static atomic<log_site_state_t *> tracked_sites{nullptr};
+};
+
+/* Size is picked so a queue slot, sequence number included, is exactly 1 KiB */
+static constexpr size_t LOG_MESSAGE_MAX = 981;
+
+/**
+ *
+ * @brief Fixed size log record, longer messages are truncated.
+ *
+ * Lives directly inside the 'LogQueue' slots so queuing a message never allocates.
+ * 'function' and 'file' point at static strings, either from a 'log_site_t' or '__func__'.
+ * 'encoding' is a 'log_encoding_t', it tells if 'message' is text or captured arguments.
+ *
+ */
 typedef struct LogMessage {
+    chrono::system_clock::time_point time;
     LogLevel level;
-    string function;
-    int line;
-    string message;
-    // Include a timestamp if you prefer logging it to be handled by the logger rather than each log call
+    i32 line;
+    const char *function;
+    const char *file;
+    u16 message_len;
+    u8 encoding;
+    char message[LOG_MESSAGE_MAX];
 } LogMessage;
 
+/**
+ *
+ * @brief Fixed size stream buffer the message text is formatted into.
+ *
+ * Reused for every message, text past 'LOG_MESSAGE_MAX' is dropped.
+ *
+ */
+class LogLineBuffer : public streambuf
+{
+public:
+	LogLineBuffer();
+
+	void reset();
+	void truncate(size_t size);
+	[[nodiscard]] size_t size() const;
+	[[nodiscard]] size_t space() const;
+	[[nodiscard]] const char* data() const;
+	[[nodiscard]] char* data();
+
+protected:
+	int_type overflow(int_type ch) override;
+
+private:
+	char storage[LOG_MESSAGE_MAX]{};
+};
+
 typedef struct window_obj_t {
     u32 value;
 } window_obj_t;
 
 typedef struct errno_msg_t {
-	string value;
+	const char *msg;
+	int err;
 } errno_msg_t;
 
+/**
+ *
+ * @brief Bounded lock-free multi-producer queue of preallocated 'LogMessage' slots.
+ *
+ * Every slot carries a sequence number that tells producers and the consumer
+ * whose turn it is, so claiming a slot is a single CAS on the shared position.
+ * Slots and both positions sit on their own cache lines.
+ *
+ */
 class LogQueue
 {
 public:
-	void push(const LogMessage& message);
+	typedef enum : u8 {
+		BLOCK,       /* Wait for the consumer to free a slot */
+		DROP_NEWEST, /* Discard the message being pushed     */
+		DROP_OLDEST  /* Discard the oldest queued message    */
+	} overflow_policy_t;
+
+	/**
+	 * @param capacity Rounded up to the next power of two.
+	 */
+	explicit LogQueue(size_t capacity = 1024, overflow_policy_t policy = BLOCK);
 
+	/**
+	 * @brief Pushes 'message' applying the overflow policy when the queue is full.
+	 * @return false if the message was dropped.
+	 */
+	bool push(const LogMessage& message);
+
+	/**
+	 * @brief Single attempt, returns false when the queue is full.
+	 */
+	bool try_push(const LogMessage& message);
 	bool try_pop(LogMessage& message);
+	bool empty() const;
+
+	void set_policy(overflow_policy_t policy);
+	[[nodiscard]] u64 dropped() const;
+	[[nodiscard]] size_t capacity() const;
+
+private:
+	typedef struct alignas(64) slot_t {
+		atomic<size_t> sequence;
+		LogMessage message;
+	} slot_t;
+
+	unique_ptr<slot_t[]> slots;
+	size_t mask;
+	atomic<overflow_policy_t> policy;
+
+	alignas(64) atomic<size_t> enqueue_pos{0};
+	alignas(64) atomic<size_t> dequeue_pos{0};
+	alignas(64) atomic<u64> dropped_count{0};
+};
+
+/**
+ *
+ * Binary log format, written by 'LOG_FORMAT_BINARY' sinks and 'LogWriter::set_binary_output'.
+ *
+ * The file starts with 'LOG_BINARY_MAGIC', then a stream of records in host byte order,
+ * each starting with a 'log_record_type_t' byte:
+ *
+ *   LOG_RECORD_SITE:    u32 site_id, u8 level, i32 line, u16 len, function, u16 len, file
+ *   LOG_RECORD_MESSAGE: u64 time_ns, u8 level, u32 site_id, u8 encoding, u16 len, payload
+ *
+ * A site record always comes before the first message that uses its id. Ids start over
+ * whenever a process opens the file, a later site record with the same id replaces the old one.
+ *
+ */
+static constexpr char LOG_BINARY_MAGIC[8] = {'N', 'X', 'L', 'O', 'G', 'B', '0', '1'};
+
+typedef enum : u8 {
+	LOG_RECORD_SITE    = 1,
+	LOG_RECORD_MESSAGE = 2
+} log_record_type_t;
+
+typedef enum : u8 {
+	LOG_ENCODING_TEXT = 0, /* Payload is the message text as 'Lout' formatted it */
+	LOG_ENCODING_ARGS = 1  /* Payload is a sequence of 'log_arg_t' tagged arguments */
+} log_encoding_t;
+
+/**
+ *
+ * Argument tags of 'LOG_ENCODING_ARGS', each tag byte is followed by its value:
+ *
+ *   LOG_ARG_TEXT:   u16 len, bytes
+ *   LOG_ARG_I64:    i64       LOG_ARG_U64: u64       LOG_ARG_F64: double
+ *   LOG_ARG_CHAR:   char, a one byte arithmetic value
+ *   LOG_ARG_WINDOW: u32 window id
+ *   LOG_ARG_ERRNO:  i32 errno, u16 len, message bytes
+ *
+ */
+typedef enum : u8 {
+	LOG_ARG_TEXT   = 1,
+	LOG_ARG_I64    = 2,
+	LOG_ARG_U64    = 3,
+	LOG_ARG_F64    = 4,
+	LOG_ARG_CHAR   = 5,
+	LOG_ARG_WINDOW = 6,
+	LOG_ARG_ERRNO  = 7
+} log_arg_t;
+
+/**
+ * @brief Appends the text 'Lout' would have formatted for a 'LOG_ENCODING_ARGS' payload.
+ */
+void render_log_args(string &out, const char *payload, size_t len);
+
+/**
+ * @brief Appends 'message' to 'out' as one colored text line, the format of the text log.
+ */
+void format_log_line(string &out, const LogMessage &message);
+
+/**
+ * @brief Same line as 'format_log_line' with every terminal escape sequence left out.
+ */
+void format_log_plain(string &out, const LogMessage &message);
+
+/**
+ * @brief Appends 'message' to 'out' as one JSON object and a newline, without escape sequences.
+ */
+void format_log_json(string &out, const LogMessage &message);
+
+[[nodiscard]] const char *log_level_name(LogLevel level);
+
+/**
+ *
+ * @brief What a 'LogSink' is written in.
+ *
+ * Text formats are rendered once per batch no matter how many sinks use them,
+ * binary records are encoded by each sink since site ids are per file.
+ *
+ */
+typedef enum log_format_t : u8 {
+	LOG_FORMAT_COLOR  = 0, /* Text with terminal colors, what 'nlog' has always contained */
+	LOG_FORMAT_PLAIN  = 1,
+	LOG_FORMAT_JSON   = 2,
+	LOG_FORMAT_BINARY = 3,
+	LOG_FORMAT_COUNT
+} log_format_t;
+
+/**
+ *
+ * @brief When a 'LogFileSink' makes what it wrote durable with fdatasync.
+ *
+ * 'LOG_SYNC_ERROR' syncs every batch holding an ERROR line before the writer moves on,
+ * 'LOG_SYNC_INTERVAL' syncs written data once the interval has passed.
+ *
+ */
+typedef enum log_sync_t : u8 {
+	LOG_SYNC_NEVER    = 0,
+	LOG_SYNC_ERROR    = 1,
+	LOG_SYNC_INTERVAL = 2
+} log_sync_t;
+
+/**
+ * @brief The records of one writer batch as one 'LogSink' gets them.
+ */
+typedef struct log_batch_t {
+	log_format_t      format;
+	const LogMessage *messages;
+	size_t            count;
+	string            text; /* Every record rendered in 'format', empty for 'LOG_FORMAT_BINARY' */
+	vector<u32>       ends; /* End offset of each record in 'text' */
+} log_batch_t;
+
+/**
+ * @brief Turns messages into binary records, remembering which sites the output already has.
+ */
+class LogBinaryEncoder
+{
+public:
+	/**
+	 * @brief Forget every site, needed whenever the output starts over.
+	 */
+	void reset();
+
+	void encode(string &out, const LogMessage &message);
+
+private:
+	map<tuple<const char*, const char*, i32, u8>, u32> site_ids{};
+};
+
+/**
+ *
+ * @brief Destination of log records, attached with 'LogWriter::add_sink'.
+ *
+ * Every method is called on the writer thread only, except 'set_level'.
+ *
+ */
+class LogSink
+{
+public:
+	explicit LogSink(log_format_t format, LogLevel level = INFO);
+	virtual ~LogSink() = default;
+
+	[[nodiscard]] log_format_t format() const;
+
+	void set_level(LogLevel level);
+	[[nodiscard]] bool accepts(LogLevel level) const;
+
+	/**
+	 * @brief Called before each batch is formatted, a sink may change its format here.
+	 */
+	virtual void prepare() {}
+
+	/**
+	 * @brief Writes the records of 'batch' that pass the level of the sink.
+	 */
+	virtual void write(const log_batch_t &batch) = 0;
+
+	/**
+	 * @brief Called when the writer runs out of messages, before it sleeps.
+	 */
+	virtual void idle() {}
+
+	virtual void close() {}
+
+protected:
+	log_format_t sink_format;
+	atomic<u8> level;
+};
+
+/**
+ *
+ * @brief Buffered file sink, text or binary, optionally rotated.
+ *
+ * Text records are written straight out of the batch with one writev per batch,
+ * runs of consecutive records become one iovec each.
+ *
+ * With rotation the active segment is 'path', closed segments are renamed to
+ * 'path.1' .. 'path.<max_segments - 1>' and the oldest one is deleted. Segments
+ * are preallocated with fallocate, written at explicit offsets and trimmed to what
+ * was written when closed. 'max_segment_bytes' 0 appends to one file forever.
+ *
+ * Output and rotation changes are thread safe and take effect at the next batch.
+ *
+ */
+class LogFileSink : public LogSink
+{
+public:
+	LogFileSink(const string &path, log_format_t format = LOG_FORMAT_COLOR, LogLevel level = INFO);
+	~LogFileSink() override;
+
+	void set_output(const string &path, log_format_t format);
+	void set_rotation(u64 max_segment_bytes, u32 max_segments);
+	void set_sync_policy(log_sync_t policy, chrono::milliseconds interval = chrono::seconds(1));
+
+	/**
+	 *
+	 * @brief Gzips closed segments to 'path.<n>.gz' on a low priority thread.
+	 *
+	 * Only applies with rotation, closed segments left uncompressed by an earlier
+	 * session are picked up too. 'nxlog-decode' reads compressed segments as they
+	 * are, text segments can be read with zcat and zgrep.
+	 *
+	 */
+	void set_compression(bool enable);
+
+	void prepare() override;
+	void write(const log_batch_t &batch) override;
+	void idle() override;
+	void close() override;
+
+private:
+	typedef struct file_config_t {
+		string       path;
+		log_format_t format;
+		u64          max_segment_bytes;
+		u32          max_segments;
+		bool         compress;
+	} file_config_t;
+
+	typedef struct compress_job_t {
+		string base;         /* 'path' of the sink when the job was queued */
+		u32    index;        /* Segment number at that time */
+		u32    max_segments;
+		u64    rotation;     /* 'rotations' of 'base' at that time, tells where the segment went since */
+	} compress_job_t;
+
+	void open_output();
+	void close_output();
+	void shift_segments();
+	[[nodiscard]] string segment_path(u32 index) const;
+	void add_text(const char *data, size_t len);
+	void write_out();
+	void sync();
+
+	void queue_compression(u32 index);
+	void compress_loop();
+	void compress_segment(const compress_job_t &job);
+
+	/* Only touched by the writer thread */
+	file_config_t config;
+	int fd = -1;
+	u64 offset = 0;
+	string out{};
+	vector<iovec> iov{};
+	size_t pending = 0;
+	LogBinaryEncoder encoder{};
+	bool dirty = false;
+	bool sync_due = false;
+	bool resume = false;           /* Set by 'close', the next open continues the segment */
+	chrono::steady_clock::time_point last_sync{};
+
+	atomic<log_sync_t> sync_policy{LOG_SYNC_NEVER};
+	atomic<chrono::milliseconds::rep> sync_interval_ms{1000};
+
+	mutex config_mutex{};
+	file_config_t pending_config;
+	atomic<bool> config_changed{false};
+
+	/* Guards the segment names, the writer renames while the compressor reads */
+	mutex compress_mutex{};
+	condition_variable compress_cv{};
+	vector<compress_job_t> compress_jobs{};
+	map<string, u64> rotations{};
+	bool compress_stop = false;
+	thread compressor{};
+};
+
+/**
+ * @brief Writes to stderr, colored by default.
+ */
+class LogStderrSink : public LogSink
+{
+public:
+	explicit LogStderrSink(log_format_t format = LOG_FORMAT_COLOR, LogLevel level = INFO);
+
+	void write(const log_batch_t &batch) override;
+};
+
+/**
+ *
+ * @brief Keeps the last 'capacity' text records in memory.
+ *
+ * Meant for an on screen console or for looking at the log from a debugger.
+ *
+ */
+class LogMemorySink : public LogSink
+{
+public:
+	explicit LogMemorySink(size_t capacity = 1024, log_format_t format = LOG_FORMAT_PLAIN, LogLevel level = INFO);
+
+	/**
+	 * @brief Copy of the held records, oldest first.
+	 */
+	[[nodiscard]] vector<string> lines() const;
+
+	void write(const log_batch_t &batch) override;
+
+private:
+	size_t capacity;
+	size_t next = 0;
+	vector<string> ring{};
+	mutable mutex ring_mutex{};
+};
+
+/**
+ *
+ * @brief Sends every record as one datagram to the unix socket at 'path'.
+ *
+ * Never blocks the writer, records the receiver can not take right now or sent
+ * while nobody listens are counted in 'dropped'. A binary datagram carries its own site record.
+ *
+ */
+class LogDatagramSink : public LogSink
+{
+public:
+	explicit LogDatagramSink(const string &path, log_format_t format = LOG_FORMAT_JSON, LogLevel level = INFO);
+	~LogDatagramSink() override;
+
+	[[nodiscard]] u64 dropped() const;
+
+	void write(const log_batch_t &batch) override;
+	void close() override;
+
+private:
+	bool connect_socket();
+	void send_record(const char *data, size_t len);
+
+	string path;
+	int fd = -1;
+	bool connected = false;
+	LogBinaryEncoder encoder{};
+	string record{};
+	atomic<u64> dropped_count{0};
+};
+
+/**
+ *
+ * @brief Process wide background writer that drains 'LogQueue'.
+ *
+ * Producers only enqueue, the writer thread takes everything that is queued
+ * as one batch, renders it once for every format its sinks use and hands it
+ * to every sink. The default sink is the rotated text log '$HOME/nlog'.
+ *
+ */
+class LogWriter
+{
+public:
+	static LogWriter& instance();
+
+	void submit(const LogMessage& message);
+
+	void set_overflow_policy(LogQueue::overflow_policy_t policy);
+
+	/**
+	 * @brief Number of messages discarded by the overflow policy.
+	 */
+	[[nodiscard]] u64 dropped() const;
+
+	/**
+	 * @brief Blocks until every message submitted before the call is written.
+	 */
+	void flush();
+
+	/**
+	 * @brief Sinks get every batch from the next one on, the writer keeps a reference.
+	 */
+	void add_sink(const shared_ptr<LogSink> &sink);
+	void remove_sink(const shared_ptr<LogSink> &sink);
+
+	/**
+	 *
+	 * @brief Switches the default log file to compact binary records written to 'path',
+	 *        an empty path switches back to the text log.
+	 *
+	 * Decode the file with the 'nxlog-decode' tool.
+	 *
+	 */
+	void set_binary_output(const string &path);
+
+	/**
+	 * @brief Directory of the text log 'nlog', defaults to $HOME.
+	 */
+	void set_log_directory(const string &directory);
+
+	/**
+	 * @brief Text format of 'nlog', 'LOG_FORMAT_COLOR' unless changed.
+	 */
+	void set_log_format(log_format_t format);
+
+	/**
+	 * @brief Rotation of the default log file, see 'LogFileSink'.
+	 */
+	void set_rotation(u64 max_segment_bytes, u32 max_segments);
+
+	/**
+	 * @brief Compression of closed segments of the default log file, see 'LogFileSink'.
+	 */
+	void set_compression(bool enable);
+
+	/**
+	 * @brief Durability of the default log file, see 'log_sync_t'.
+	 */
+	void set_sync_policy(log_sync_t policy, chrono::milliseconds interval = chrono::seconds(1));
+
+	/**
+	 *
+	 * @brief A batch is written once it has 'max_records' messages or 'max_delay'
+	 *        after its first one, whichever comes first.
+	 *
+	 * An ERROR message or a 'flush' ends the wait right away. A delay of 0 writes
+	 * whatever is queued as soon as the writer gets to it.
+	 *
+	 */
+	void set_batching(u32 max_records, chrono::microseconds max_delay);
+
+	/**
+	 *
+	 * @brief Messages below 'level' are not queued for any sink.
+	 *
+	 * They still reach the 'LogFlightRecorder', so full detail can be kept
+	 * in memory while only warnings and errors pay for file I/O.
+	 *
+	 */
+	void set_min_level(LogLevel level);
+	[[nodiscard]] bool accepts(LogLevel level) const;
+
+	/**
+	 *
+	 * @brief Drains the queue, stops the writer thread and closes the sinks.
+	 *
+	 * Runs from 'atexit', the writer itself is never destroyed. Messages logged
+	 * after this, e.g. from static destructors, are written on the calling thread.
+	 *
+	 */
+	void shutdown();
+
+	~LogWriter();
+
+private:
+	LogWriter();
+
+	void run();
+	void write_pending();
+	void submit_notes(bool all);
+	void wake();
+	void apply_config();
+	void update_file_output();
+	size_t gather(size_t count, size_t limit);
+	void write_batch(size_t count);
+
+	LogQueue queue{};
+	shared_ptr<LogFileSink> file_sink;
+
+	/* Only touched by the writer thread */
+	vector<LogMessage> messages{};
+	log_batch_t batches[LOG_FORMAT_COUNT]{};
+	vector<shared_ptr<LogSink>> sinks{};
+
+	/* Default file output, guarded by 'config_mutex' */
+	string file_directory{};
+	string file_binary_path{};
+	log_format_t file_format = LOG_FORMAT_COLOR;
+
+	mutex config_mutex{};
+	vector<shared_ptr<LogSink>> pending_sinks{};
+	atomic<bool> config_changed{false};
+
+	mutex wake_mutex{};
+	condition_variable wake_cv{};
+	condition_variable drained_cv{};
+	atomic<bool> running{true};
+	atomic<bool> sleeping{false};
+	atomic<u64> submitted{0};
+	atomic<u64> written{0};
+	atomic<u8> min_level{INFO};
+	atomic<u32> batch_records;
+	atomic<chrono::microseconds::rep> batch_delay_us;
+	atomic<u32> flushing{0};
+
+	mutex stopped_mutex{};
+	atomic<bool> stopped{false};
+
+	thread worker{};
+};
+
+/**
+ *
+ * @brief Crash surviving ring of the most recent log messages in a shared file mapping.
+ *
+ * 'Lout' copies every message that passes 'LogFilter' into the ring on the logging
+ * thread with plain memory stores, the kernel keeps the pages after the process dies.
+ * Read the ring back with the 'nxlog-flight' tool.
+ *
+ * File layout: 'flight_header_t', then 'capacity' bytes of ring. Every record is a
+ * 'flight_record_t' followed by its payload, records wrap around the end of the ring:
+ *
+ *   u64 time_ns, u8 level, u8 encoding, i32 line, u16 len, function, u16 len, message
+ *
+ */
+class LogFlightRecorder
+{
+public:
+	static constexpr char MAGIC[8]      = {'N', 'X', 'F', 'L', 'I', 'G', 'H', 'T'};
+	static constexpr u32  RECORD_MARKER = 0x4C46584E;
+
+	typedef struct flight_header_t {
+		char        magic[8];
+		u64         capacity;
+		atomic<u64> head;     /* Total bytes ever reserved, the ring position is head % capacity */
+		char        pad[40];
+	} flight_header_t;
+
+	typedef struct flight_record_t {
+		u32 marker;           /* Stored last, a record without it was torn by the crash */
+		u32 len;              /* Payload bytes after this header */
+		u64 pos;              /* Value of 'head' the record was reserved at */
+	} flight_record_t;
+
+	/**
+	 *
+	 * @brief Maps 'path' with room for 'capacity' bytes of messages and starts recording.
+	 *
+	 * A ring left by a previous session is moved to '<path>.prev' first, so a
+	 * restart after a crash does not overwrite what needs to be looked at.
+	 *
+	 */
+	static bool start(const string &path, size_t capacity = 4 * 1024 * 1024);
+
+	/**
+	 * @brief Stops recording, the mapping stays in place for threads still writing to it.
+	 */
+	static void stop();
+
+	static void record(const LogMessage &message);
+
+	[[nodiscard]] static bool active()
+	{
+		return header.load(memory_order_acquire) != nullptr;
+	}
 
 private:
-	mutex mutex_;
-	queue<LogMessage> queue_;
+	static void copy_in(const flight_header_t *ring, u64 pos, const void *data, size_t len);
+
+	inline static atomic<flight_header_t*> header{nullptr};
 };
 
 class Lout
@@ -188,11 +1043,47 @@ public:
 
 	Lout& operator<<(const errno_msg_t &err);
 
+	/**
+	 * @brief Takes level, function, file and line from the call site in one go.
+	 */
+	Lout& operator<<(const log_site_t *site);
+
+	/**
+	 *
+	 * @brief Capture arguments raw and leave the formatting to the writer thread.
+	 *
+	 * Numbers, window ids, errno values and strings are copied into the queued record
+	 * as tagged values, anything else is still formatted here. Applies from the next message on.
+	 *
+	 */
+	static void set_deferred_formatting(bool enable);
+
 	template<typename T>
 	enable_if_t<is_arithmetic_v<T>, Lout&>
 	operator<<(T value)
 	{
-		buffer << loutNUM(value);
+		if (!deferred)
+		{
+			out << loutNUM(value);
+		}
+		else if constexpr (is_floating_point_v<T>)
+		{
+			put_arg(LOG_ARG_F64, static_cast<double>(value));
+		}
+		else if constexpr (sizeof(T) == 1 && !is_same_v<T, bool>)
+		{
+			/* ostream prints one byte integers as characters */
+			put_arg(LOG_ARG_CHAR, static_cast<char>(value));
+		}
+		else if constexpr (is_signed_v<T>)
+		{
+			put_arg(LOG_ARG_I64, static_cast<i64>(value));
+		}
+		else
+		{
+			put_arg(LOG_ARG_U64, static_cast<u64>(value));
+		}
+
 		return *this;
 	}
 
@@ -200,25 +1091,80 @@ public:
 	enable_if_t<!is_arithmetic_v<T>, Lout&>
 	operator<<(const T& message)
 	{
-		buffer << message;
+		if (!deferred)
+		{
+			out << message;
+		}
+		else if constexpr (is_convertible_v<const T&, string_view>)
+		{
+			const string_view text(message);
+			put_text(text.data(), text.size());
+		}
+		else
+		{
+			const size_t start = begin_text();
+			out << message;
+			end_text(start);
+		}
+
 		return *this;
 	}
 
 private:
 /* Variabels */
 	LogLevel currentLevel{};
-	string currentFunction{};
-	string current_file{};
+	const log_site_t *current_site = nullptr;
+	const char *currentFunction = "";
+	const char *current_file = "";
 	int current_line{};
-	ostringstream buffer{};
-	mutex log_mutex{};
+	LogLineBuffer line{};
+	ostream out{&line};
+
+	/* Latched when a message starts, so one message never mixes text and arguments */
+	bool deferred = false;
+	/* Offset of the length of the last 'LOG_ARG_TEXT', consecutive text is merged into it */
+	size_t open_text = SIZE_MAX;
+	inline static atomic<bool> deferred_formatting{false};
 
 	string cur_user{};
 
+	void start_message();
+	void put_text(const char *text, size_t len);
+	size_t begin_text();
+	void end_text(size_t start);
+
+	template<typename T>
+	void put_arg(const log_arg_t tag, const T value)
+	{
+		if (line.space() < 1 + sizeof(T))
+		{
+			return;
+		}
+
+		line.sputc(static_cast<char>(tag));
+		line.sputn(reinterpret_cast<const char *>(&value), sizeof(T));
+		open_text = SIZE_MAX;
+	}
+
 	void logMessage();
+	void log_note(const LogMessage &message, const char *format, u32 count);
+	static void submit(const LogMessage &message);
 	static string getLogPrefix(LogLevel level);
+
+	friend void format_log_line(string &out, const LogMessage &message);
 };
-static Lout lout;
+
+/**
+ *
+ * @brief One 'Lout' per thread, all of them feed the process wide 'LogWriter'.
+ *
+ * Threads format into their own line buffer without locking and only
+ * meet at the lock-free 'LogQueue', so lines from different threads never mix.
+ * It is never destroyed, static destructors still log after the thread_local
+ * destructors of the main thread have run.
+ *
+ */
+extern thread_local Lout &lout;
 
 // Utility function for wrapping function names
 FuncNameWrapper func(const char* name);
@@ -241,16 +1187,30 @@ errno_msg_t errno_msg(const char* str);
 #define WINDOW_ID_BY_INPUT(__window) \
 	window_id(__window)
 
+/**
+ *
+ * @brief Starts a log statement at '__level', the rest of the '<<' chain
+ *        is only evaluated when the level passes both filters and the
+ *        call site is within its 'LogRateLimit'.
+ *
+ * Safe to use as the body of an unbraced 'if', every 'if' here has an 'else'.
+ *
+ */
+#define LOUT_AT(__level) \
+	if constexpr ((__level) < NXLIB_LOG_MIN_LEVEL) {} \
+	else if (const log_site_t *__lout_site = LOG_SITE(__level); !LogFilter::enabled(__lout_site) || !LogRateLimit::admit(__lout_site)) {} \
+	else lout << __lout_site
+
 /* LOG DEFENITIONS */
 #define loutWin(__window) \
-	lout << INFO << LINE << FUNC << WINDOW_ID_BY_INPUT(__window) << loutEND
+	LOUT_AT(INFO) << WINDOW_ID_BY_INPUT(__window) << loutEND
 
 /**
  * @brief Macro to log info to the log file
  *        using the lout class
  */
 #define loutI \
-    lout << INFO << FUNC << LINE
+    LOUT_AT(INFO)
 
 /**
  *
@@ -267,7 +1227,7 @@ errno_msg_t errno_msg(const char* str);
  *        using the lout class
  */
 #define loutE \
-	lout << ERROR << FUNC << LINE
+	LOUT_AT(ERROR)
 
 #define loutErrno(__msg) \
 	loutE << ERRNO_MSG(__msg) << '\n'
@@ -290,7 +1250,7 @@ errno_msg_t errno_msg(const char* str);
  *        using the lout class
  */
 #define loutW \
-    lout << WARNING << FUNC << LINE
+    LOUT_AT(WARNING)
 
 /**
  *
@@ -307,7 +1267,7 @@ errno_msg_t errno_msg(const char* str);
  *        using the lout class
  */
 #define loutIP \
-    lout << INFO_PRIORITY << FUNC << LINE
+    LOUT_AT(INFO_PRIORITY)
 
 #define loutCUser(__user) \
 	loutI << "Current USER" << loutUser(__user) << '\n'
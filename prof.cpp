@@ -63,6 +63,28 @@
 
 
 #include "prof.h"
+#include "TIME.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cxxabi.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <cstring>
+#include <ctime>
+#include <thread>
+
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <cpuid.h>
+#endif
 
 
 using namespace std;
@@ -70,161 +92,1603 @@ using namespace std;
 
 namespace NXlib
 {
+    /*********************************************************************
+    *****************<<          ProfilerClock        >>******************
+    *********************************************************************/
+
+    static u64 monotonic_raw_ns()
+    {
+        timespec ts{};
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return static_cast<u64>(ts.tv_sec) * 1'000'000'000 + static_cast<u64>(ts.tv_nsec);
+    }
+
+    bool ProfilerClock::set_source(const source_t source)
+    {
+        if (source == STEADY)
+        {
+            tsc.store(false);
+            ms_per_tick.store(1e-6);
+            return true;
+        }
+
+    #if defined(__x86_64__) || defined(__i386__)
+        /* Invariant TSC: CPUID 0x80000007 EDX bit 8, rdtscp: CPUID 0x80000001 EDX bit 27 */
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & 1u << 8)
+         || !__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) || !(edx & 1u << 27))
+        {
+            return false;
+        }
+
+        /* Each side takes the TSC between two clock reads and uses their midpoint */
+        const auto sample = [](u64 &ns, u64 &ticks)
+        {
+            unsigned  aux;
+            const u64 before = monotonic_raw_ns();
+            ticks            = __rdtscp(&aux);
+            ns               = before + (monotonic_raw_ns() - before) / 2;
+        };
+
+        u64 ns0, ticks0, ns1, ticks1;
+        sample(ns0, ticks0);
+        this_thread::sleep_for(chrono::milliseconds(20));
+        sample(ns1, ticks1);
+
+        if (ticks1 <= ticks0)
+        {
+            return false;
+        }
+
+        ms_per_tick.store(static_cast<double>(ns1 - ns0) / 1e6 / static_cast<double>(ticks1 - ticks0));
+        tsc.store(true);
+        return true;
+    #else
+        return false;
+    #endif
+    }
+
+    ProfilerClock::source_t ProfilerClock::source()
+    {
+        return tsc.load(memory_order_relaxed) ? TSC : STEADY;
+    }
+
+    double ProfilerClock::to_ms(const double ticks)
+    {
+        return ticks * ms_per_tick.load(memory_order_relaxed);
+    }
+
+    u64 ProfilerClock::from_ms(const double ms)
+    {
+        return static_cast<u64>(std::max(ms, 0.0) / ms_per_tick.load(memory_order_relaxed));
+    }
+
     /*********************************************************************
     *****************<<          ProfilerStats        >>******************
     *********************************************************************/
 
-    void ProfilerStats::record(const double value)
+    void ProfilerStats::record(const double ms)
     {
-        values.push_back(value);
+        record_ticks(ProfilerClock::from_ms(ms));
     }
 
-    double ProfilerStats::mean() const
+    void ProfilerStats::record_ticks(const u64 ticks)
     {
-        if (values.empty())
+        /* Welford, numerically stable for any number of samples */
+        ++n;
+        const auto   value = static_cast<double>(ticks);
+        const double delta = value - m1;
+        m1 += delta / static_cast<double>(n);
+        m2 += delta * (value - m1);
+
+        lowest  = n == 1 ? ticks : std::min(lowest, ticks);
+        highest = n == 1 ? ticks : std::max(highest, ticks);
+
+        const u32 bucket = bucket_of(ticks);
+        if (bucket >= buckets.size())
         {
-            return 0.0;
+            buckets.resize(bucket + 1);
         }
 
-        const double sum = accumulate(values.begin(), values.end(), 0.0);
-        return sum / static_cast<double>(values.size());
+        ++buckets[bucket];
+    }
+
+    double ProfilerStats::mean() const
+    {
+        return ProfilerClock::to_ms(m1);
     }
 
     double ProfilerStats::stddev() const
     {
-        if (values.size() < 2)
+        if (n < 2)
         {
             return 0.0;
         }
 
-        double mean_val = mean();
-        const double sq_sum = std::accumulate(values.begin(), values.end(), 0.0, [mean_val](double a, double b) { return a + (b - mean_val) * (b - mean_val); });
-        return std::sqrt(sq_sum / static_cast<double>(values.size()));
+        return ProfilerClock::to_ms(std::sqrt(m2 / static_cast<double>(n)));
     }
 
     double ProfilerStats::min() const
     {
-        return values.empty() ? 0.0 : *ranges::min_element(values.begin(), values.end());
+        return ProfilerClock::to_ms(static_cast<double>(lowest));
     }
 
     double ProfilerStats::max() const
     {
-        return values.empty() ? 0.0 : *ranges::max_element(values.begin(), values.end());
+        return ProfilerClock::to_ms(static_cast<double>(highest));
     }
 
     size_t ProfilerStats::count() const
     {
-        return values.size();
+        return n;
+    }
+
+    double ProfilerStats::percentile(const double p) const
+    {
+        if (n == 0)
+        {
+            return 0.0;
+        }
+
+        const auto rank = static_cast<u64>(std::ceil(std::clamp(p, 0.0, 1.0) * static_cast<double>(n)));
+        u64 seen = 0;
+        for (u32 i = 0; i < buckets.size(); ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank && seen != 0)
+            {
+                /* The bucket midpoint can lie outside of what was actually recorded */
+                return ProfilerClock::to_ms(std::clamp(bucket_value(i), static_cast<double>(lowest), static_cast<double>(highest)));
+            }
+        }
+
+        return max();
+    }
+
+    void ProfilerStats::merge(const ProfilerStats &other)
+    {
+        if (other.n == 0)
+        {
+            return;
+        }
+
+        /* Chan et al., the parallel form of Welford */
+        const std_size_t total = n + other.n;
+        const double     delta = other.m1 - m1;
+        m2 += other.m2 + delta * delta * static_cast<double>(n) * static_cast<double>(other.n) / static_cast<double>(total);
+        m1 += delta * static_cast<double>(other.n) / static_cast<double>(total);
+
+        lowest  = n == 0 ? other.lowest : std::min(lowest, other.lowest);
+        highest = n == 0 ? other.highest : std::max(highest, other.highest);
+        n       = total;
+
+        if (buckets.size() < other.buckets.size())
+        {
+            buckets.resize(other.buckets.size());
+        }
+
+        for (size_t i = 0; i < other.buckets.size(); ++i)
+        {
+            buckets[i] += other.buckets[i];
+        }
+    }
+
+    /**
+     *
+     * Values below 'SUB_BUCKETS' ticks get a bucket each, above that every power of two
+     * is split into 'SUB_BUCKETS' equal buckets by the bits below the highest one.
+     *
+     */
+    u32 ProfilerStats::bucket_of(const u64 ticks)
+    {
+        if (ticks < SUB_BUCKETS)
+        {
+            return static_cast<u32>(ticks);
+        }
+
+        const u32 shift = static_cast<u32>(63 - __builtin_clzll(ticks)) - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<u32>(ticks >> shift) - SUB_BUCKETS;
+    }
+
+    double ProfilerStats::bucket_value(const u32 bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+        {
+            return bucket;
+        }
+
+        const u32 shift = bucket / SUB_BUCKETS - 1;
+        const u64 low   = static_cast<u64>(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return static_cast<double>(low) + static_cast<double>(1ULL << shift) / 2.0;
     }
 
     /*********************************************************************
     *****************<<        GlobalProfiler         >>******************
     *********************************************************************/
 
-    void GlobalProfiler::record(string const &name, double const duration)
+    /*
+     *
+     * Everything the SIGPROF handler touches. The buffer is allocated once and never freed,
+     * a late signal may still be running after 'stop_sampling'.
+     *
+     */
+    static constexpr u32 SAMPLE_DEPTH = 64;
+
+    typedef struct sample_t {
+        atomic<u32> depth;   /* 0 until the frames are written */
+        void *frames[SAMPLE_DEPTH];
+    } sample_t;
+
+    static atomic<sample_t *> samples{nullptr};
+    static atomic<std_size_t> sample_capacity{0};
+    static atomic<std_size_t> sample_next{0};
+    static atomic<bool>       sampling{false};
+
+    static atomic<bool> tracking_allocations{false};
+
+    /*
+     *
+     * Non zero while this thread runs profiler code. What the profiler allocates for itself
+     * is not charged to the user's scope, and 'allocated' never opens a shard write
+     * inside one this thread already has open.
+     *
+     */
+    static thread_local u32 inside_profiler = 0;
+
+    typedef struct profiler_section_t {
+        profiler_section_t()  { ++inside_profiler; }
+        ~profiler_section_t() { --inside_profiler; }
+    } profiler_section_t;
+
+    /* Runs 'copy' until it saw none of the owning thread's writes, see 'begin_write' */
+    template<typename Copy>
+    static void read_stable(const atomic<u32> &seq, Copy &&copy)
     {
-        stats[name].record(duration);
+        for (;;)
+        {
+            const u32 before = seq.load(memory_order_acquire);
+            if ((before & 1) != 0)
+            {
+                this_thread::yield();
+                continue;
+            }
+
+            copy();
+            atomic_thread_fence(memory_order_acquire);
+            if (seq.load(memory_order_relaxed) == before)
+            {
+                return;
+            }
+        }
     }
 
-    string makeNamePadding(const string& s)
+    GlobalProfiler& GlobalProfiler::instance()
     {
-        stringstream ss;
-        for (int i = 0; (i + s.length()) < 30; ++i)
+        /* Never destroyed, the report runs from 'atexit' and may outlive static destructors */
+        static GlobalProfiler *profiler = new GlobalProfiler;
+        return *profiler;
+    }
+
+    GlobalProfiler::shard_t& GlobalProfiler::local_shard()
+    {
+        shard_t *&shard = thread_shard;
+        if (shard == nullptr)
         {
-            ss << ' ';
+            lock_guard<mutex> guard(shards_mutex);
+            shard = shards.emplace_back(make_unique<shard_t>()).get();
+            shard->tid = static_cast<i32>(gettid());
+
+            char name[16] = {};
+            prctl(PR_GET_NAME, name);
+            shard->thread_name = name;
+
+            /* A scope in a thread_local destructor that runs after this one gets a shard that is never retired */
+            static thread_local shard_owner_t owner;
+            (void)owner;
         }
 
-        return ss.str();
+        return *shard;
     }
 
-    string mili()
+    GlobalProfiler::shard_owner_t::~shard_owner_t()
     {
-        // Get the current time point
-        const auto now = chrono::system_clock::now();
+        if (thread_shard != nullptr)
+        {
+            instance().retire(thread_shard);
+        }
+    }
 
-        // Convert to time_t for seconds and tm for local time
-        const auto in_time_t = chrono::system_clock::to_time_t(now);
-        tm buf{};
-        localtime_r(&in_time_t, &buf);
+    void GlobalProfiler::retire(shard_t *shard)
+    {
+        const profiler_section_t section;
 
-        // Use stringstream to format the time
-        ostringstream ss;
-        ss << "[" << put_time(&buf, "%Y-%m-%d %H:%M:%S");
+        /* 'allocated' must not find it anymore */
+        thread_shard = nullptr;
 
-        // Calculate milliseconds (now time since epoch minus time_t converted back to time since epoch)
-        auto since_epoch = now.time_since_epoch();
-        const auto s = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
-        since_epoch -= s;
-        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch);
+        lock_guard<mutex> guard(shards_mutex);
+        if (exited == nullptr)
+        {
+            exited = shards.emplace_back(make_unique<shard_t>()).get();
+            exited->thread_name = "exited threads";
+        }
 
-        // Append milliseconds to the formatted string, correctly placing the closing square bracket
-        ss << "." << setfill('0') << setw(3) << ms.count() << "]";
+        {
+            lock_guard<mutex> exited_guard(exited->lock);
+            lock_guard<mutex> shard_guard(shard->lock);
+            const std_size_t capacity = trace_capacity.load();
+            flip(*shard, capacity);
 
-        return ss.str();
+            if (exited->stats.size() < shard->stats.size())
+            {
+                exited->stats.resize(shard->stats.size());
+            }
+
+            for (u32 id = 0; id < shard->stats.size(); ++id)
+            {
+                exited->stats[id].merge(shard->stats[id]);
+            }
+
+            if (exited->counters.size() < shard->counters.size())
+            {
+                exited->counters.resize(shard->counters.size());
+            }
+
+            for (u32 id = 0; id < shard->counters.size(); ++id)
+            {
+                counters_t &into = exited->counters[id];
+                into.hardware_calls += shard->counters[id].hardware_calls;
+                into.software_calls += shard->counters[id].software_calls;
+                for (u32 i = 0; i < COUNTER_COUNT; ++i)
+                {
+                    into.values[i] += shard->counters[id].values[i];
+                }
+            }
+
+            merge_nodes(*shard, 0, *exited, 0);
+        }
+
+        if (!shard->events.empty() || shard->dropped != 0)
+        {
+            const std_size_t room = trace_capacity.load() > exited_events ? trace_capacity.load() - exited_events : 0;
+            const std_size_t kept = std::min(room, shard->events.size());
+            const std_size_t lost = shard->events.size() - kept;
+            shard->events.resize(kept);
+            exited_events += kept;
+            exited_traces.push_back({shard->tid, shard->thread_name, std::move(shard->events), shard->dropped + lost});
+        }
+
+        erase_if(shards, [shard](const unique_ptr<shard_t> &owned) { return owned.get() == shard; });
     }
 
-    void GlobalProfiler::report(string const &filename) const
+    /* Adds the subtree below 'from_node' to the one below 'into_node', matching children by scope id */
+    void GlobalProfiler::merge_nodes(const shard_t &from, const u32 from_node, shard_t &into, const u32 into_node)
     {
-        ofstream file(filename, ios::app);
-        file << "\n\nProfiling report: " << mili() << '\n';
-        for (const auto & [fst, snd] : stats)
+        for (const u32 child : from.nodes[from_node].children)
         {
-            file <<
-                fst << makeNamePadding(fst) <<
-                ": Mean = " << snd.mean()   << " ms, " << /* makeDoublePadding(pair.second.mean())   << */
-                "Stddev = " << snd.stddev() << " ms, " << /* makeDoublePadding(pair.second.stddev()) << */
-                "   Min = " << snd.min()    << " ms, " << /* makeDoublePadding(pair.second.min())    << */
-                "   Max = " << snd.max()    << " ms, " << /* makeDoublePadding(pair.second.max())    << */
-                " Count = " << snd.count()  <<           /* makeDoublePadding(pair.second.count())  << */
-            "\n";
+            const call_node_t &call = from.nodes[child];
+            const vector<u32> &siblings = into.nodes[into_node].children;
+
+            const auto it = find_if(siblings.begin(), siblings.end(), [&into, &call](const u32 node) { return into.nodes[node].id == call.id; });
+            u32 target;
+            if (it != siblings.end())
+            {
+                target = *it;
+            }
+            else
+            {
+                target = static_cast<u32>(into.nodes.size());
+                into.nodes.push_back({.id = call.id, .parent = into_node, .children = {}});
+                into.nodes[into_node].children.push_back(target);
+            }
+
+            call_node_t &node = into.nodes[target];
+            node.calls           += call.calls;
+            node.total           += call.total;
+            node.child           += call.child;
+            node.allocations     += call.allocations;
+            node.allocated_bytes += call.allocated_bytes;
+            merge_nodes(from, child, into, target);
         }
+    }
 
-        file.close();
+    u32 GlobalProfiler::intern(string const &name)
+    {
+        const profiler_section_t section;
+        lock_guard<mutex> guard(names_mutex);
+        const auto [it, added] = ids.try_emplace(name, static_cast<u32>(names.size()));
+        if (added)
+        {
+            names.push_back(name);
+        }
+
+        return it->second;
+    }
 
-        for (const auto &i : stats)
+    u32 GlobalProfiler::id_of(string const &name)
+    {
+        const profiler_section_t section;
+        shard_t &shard = local_shard();
+        if (const auto it = shard.ids.find(name); it != shard.ids.end())
         {
-            ofstream File("/home/mellw/gprof/" + i.first, ios::app);
-            File <<
-                i.second.mean()   << ':' <<
-                i.second.stddev() << ':' <<
-                i.second.min()    << ':' <<
-                i.second.max()    << ':' <<
-                i.second.count()  << ':' <<
-            "\n";
+            return it->second;
         }
+
+        const u32 id = intern(name);
+        shard.ids.emplace(name, id);
+        return id;
     }
 
-    GlobalProfiler *GlobalProfiler::createNewGprof()
+    void GlobalProfiler::record(const u32 id, const double duration)
     {
-        return new GlobalProfiler;
+        record_ticks(id, ProfilerClock::from_ms(duration));
     }
 
-    void init_gProf()
+    void GlobalProfiler::record_ticks(const u32 id, const u64 ticks)
     {
-        gProf = GlobalProfiler::createNewGprof();
+        const profiler_section_t section;
+        shard_t &shard = local_shard();
+
+        window_t &window = begin_write(shard);
+        if (id >= window.stats.size())
+        {
+            window.stats.resize(id + 1);
+        }
+
+        window.stats[id].record_ticks(ticks);
+        end_write(shard);
     }
 
-    /*********************************************************************
-    *****************<<            AutoTimer          >>******************
-    *********************************************************************/
+    void GlobalProfiler::record(const u32 id, const u64 begin, const u64 end)
+    {
+        const profiler_section_t section;
+        shard_t &shard = local_shard();
 
-    AutoTimer::AutoTimer(string name)
-    : name(move(name)), start(chrono::high_resolution_clock::now())
-    {}
+        record(begin_write(shard), id, begin, end);
+        end_write(shard);
+    }
 
-    AutoTimer::~AutoTimer()
+    /* Caller is between 'begin_write' and 'end_write' */
+    void GlobalProfiler::record(window_t &window, const u32 id, const u64 begin, const u64 end)
     {
-        const auto end = chrono::high_resolution_clock::now();
-        const chrono::duration<double, milli> duration = end - start;
-        gProf->record(name, duration.count());
+        if (id >= window.stats.size())
+        {
+            window.stats.resize(id + 1);
+        }
+
+        window.stats[id].record_ticks(end - begin);
+        if (!tracing.load(memory_order_relaxed))
+        {
+            return;
+        }
+
+        if (window.events.size() < trace_capacity.load(memory_order_relaxed))
+        {
+            window.events.push_back({id, begin, end});
+        }
+        else
+        {
+            ++window.dropped;
+        }
     }
 
-    /* Register at-exit handler to generate the report */
-    void setupReportGeneration()
+    u32 GlobalProfiler::enter(const u32 id)
     {
-        atexit([]
+        const profiler_section_t section;
+        shard_t &shard = local_shard();
+
+        /* Only this thread changes its nodes, so looking up needs no lock */
+        const vector<u32> &children = shard.nodes[shard.current].children;
+        const auto it = find_if(children.begin(), children.end(), [&shard, id](const u32 child) { return shard.nodes[child].id == id; });
+        if (it != children.end())
         {
-            gProf->report("/home/mellw/profiling_report.txt");
-        });
+            shard.current = *it;
+        }
+        else
+        {
+            lock_guard<mutex> guard(shard.lock);
+            const auto node = static_cast<u32>(shard.nodes.size());
+            shard.nodes.push_back({.id = id, .parent = shard.current, .children = {}});
+            shard.nodes[shard.current].children.push_back(node);
+            shard.current = node;
+        }
+
+        if (shard.sample_generation != sampling_generation.load(memory_order_relaxed))
+        {
+            sample_thread();
+        }
+
+        if (counting.load(memory_order_relaxed))
+        {
+            if (shard.counter_source == COUNTERS_UNTRIED)
+            {
+                open_counters(shard);
+            }
+
+            /* Read last, so the counters start as close to the scope body as possible */
+            call_node_t &call = shard.nodes[shard.current];
+            call.counting     = read_counters(shard, call.counter_start);
+        }
+
+        return shard.current;
+    }
+
+    void GlobalProfiler::leave(const u32 node, const u64 begin, const u64 end)
+    {
+        const profiler_section_t section;
+        shard_t &shard = local_shard();
+        call_node_t &call = shard.nodes[node];
+
+        u64 counter_end[COUNTER_COUNT];
+        const bool counted = call.counting && read_counters(shard, counter_end);
+        call.counting = false;
+
+        /* 'merged_counters' reads them in place, so they only grow under the lock */
+        if (counted && call.id >= shard.counters.size())
+        {
+            lock_guard<mutex> guard(shard.lock);
+            shard.counters.resize(call.id + 1);
+        }
+
+        window_t &window = begin_write(shard);
+        if (counted)
+        {
+            counters_t &counters = shard.counters[call.id];
+            ++(shard.counter_source == COUNTERS_HARDWARE ? counters.hardware_calls : counters.software_calls);
+            for (u32 i = 0; i < COUNTER_COUNT; ++i)
+            {
+                counters.values[i] += counter_end[i] - call.counter_start[i];
+            }
+        }
+
+        ++call.calls;
+        call.total += end - begin;
+        shard.nodes[call.parent].child += end - begin;
+        shard.current = call.parent;
+
+        record(window, call.id, begin, end);
+        end_write(shard);
+    }
+
+    void GlobalProfiler::record(string const &name, double const duration)
+    {
+        record(id_of(name), duration);
+    }
+
+    GlobalProfiler::window_t& GlobalProfiler::begin_write(shard_t &shard)
+    {
+        /*
+         *
+         * Only readers of this shard's nodes and counters check 'seq' for a torn copy,
+         * the windows are never read while written. Both this and 'flip' use seq_cst,
+         * so either 'flip' sees the odd count and waits or this sees the new window.
+         *
+         */
+        shard.seq.fetch_add(1, memory_order_seq_cst);
+        return shard.windows[shard.active.load(memory_order_seq_cst)];
     }
-} // NXlib
\ No newline at end of file
+
+    void GlobalProfiler::end_write(shard_t &shard)
+    {
+        shard.seq.fetch_add(1, memory_order_release);
+    }
+
+    void GlobalProfiler::flip(shard_t &shard, const std_size_t capacity)
+    {
+        const u32 old = shard.active.load(memory_order_relaxed);
+        shard.active.store(old ^ 1, memory_order_seq_cst);
+        while ((shard.seq.load(memory_order_seq_cst) & 1) != 0)
+        {
+            this_thread::yield();
+        }
+
+        /* The owning thread now only writes the other window until the next flip, which needs the lock */
+        window_t &window = shard.windows[old];
+        if (shard.stats.size() < window.stats.size())
+        {
+            shard.stats.resize(window.stats.size());
+        }
+
+        for (u32 id = 0; id < window.stats.size(); ++id)
+        {
+            shard.stats[id].merge(window.stats[id]);
+        }
+
+        const std_size_t room = capacity > shard.events.size() ? capacity - shard.events.size() : 0;
+        const std_size_t kept = std::min(room, window.events.size());
+        shard.events.insert(shard.events.end(), window.events.begin(), window.events.begin() + static_cast<ptrdiff_t>(kept));
+        shard.dropped += window.dropped + window.events.size() - kept;
+
+        window.stats.clear();
+        window.events.clear();
+        window.dropped = 0;
+    }
+
+    map<string, ProfilerStats> GlobalProfiler::merged() const
+    {
+        const profiler_section_t section;
+        lock_guard<mutex> snapshot_guard(snapshot_mutex);
+        map<string, ProfilerStats> stats = retired;
+
+        lock_guard<mutex> guard(shards_mutex);
+        lock_guard<mutex> names_guard(names_mutex);
+        const std_size_t capacity = trace_capacity.load();
+        for (const auto &shard : shards)
+        {
+            lock_guard<mutex> shard_guard(shard->lock);
+            flip(*shard, capacity);
+            for (u32 id = 0; id < shard->stats.size(); ++id)
+            {
+                if (shard->stats[id].count() != 0)
+                {
+                    stats[names[id]].merge(shard->stats[id]);
+                }
+            }
+        }
+
+        return stats;
+    }
+
+    GlobalProfiler::call_tree_t GlobalProfiler::call_tree() const
+    {
+        const profiler_section_t section;
+        call_tree_t root;
+
+        /* Walks one shard's nodes alongside the merged tree, matching children by name */
+        const auto merge = [this](const auto &self, const shard_t &shard, const u32 node, call_tree_t &into) -> void
+        {
+            for (const u32 child : shard.nodes[node].children)
+            {
+                const call_node_t &call = shard.nodes[child];
+                string const &name = names[call.id];
+
+                u64 calls, total, inner;
+                read_stable(shard.seq, [&] { calls = call.calls; total = call.total; inner = call.child; });
+
+                auto it = find_if(into.children.begin(), into.children.end(),
+                    [&name](const call_tree_t &tree) { return tree.name == name; });
+                if (it == into.children.end())
+                {
+                    it = into.children.insert(it, call_tree_t{.name = name, .children = {}});
+                }
+
+                it->calls += calls;
+                it->total += total;
+                it->child += inner;
+                self(self, shard, child, *it);
+            }
+        };
+
+        lock_guard<mutex> guard(shards_mutex);
+        lock_guard<mutex> names_guard(names_mutex);
+        for (const auto &shard : shards)
+        {
+            lock_guard<mutex> shard_guard(shard->lock);
+            merge(merge, *shard, 0, root);
+        }
+
+        return root;
+    }
+
+    static void write_call_tree(ofstream &file, const GlobalProfiler::call_tree_t &tree, const u32 depth)
+    {
+        vector<const GlobalProfiler::call_tree_t *> children;
+        for (const auto &child : tree.children)
+        {
+            children.push_back(&child);
+        }
+
+        sort(children.begin(), children.end(), [](const auto *a, const auto *b) { return a->total > b->total; });
+        for (const auto *child : children)
+        {
+            const string name = string(depth * 2, ' ') + child->name;
+            file <<
+                name << string(name.length() < 40 ? 40 - name.length() : 1, ' ') <<
+                ": Total = " << ProfilerClock::to_ms(static_cast<double>(child->total)) << " ms, " <<
+                "  Self = "  << ProfilerClock::to_ms(static_cast<double>(child->total - child->child)) << " ms, " <<
+                " Calls = "  << child->calls <<
+            "\n";
+
+            write_call_tree(file, *child, depth + 1);
+        }
+    }
+
+    static void write_folded(ofstream &file, const GlobalProfiler::call_tree_t &tree, string const &stack)
+    {
+        for (const auto &child : tree.children)
+        {
+            const string path = stack.empty() ? child.name : stack + ';' + child.name;
+            const auto   self = static_cast<u64>(ProfilerClock::to_ms(static_cast<double>(child.total - child.child)) * 1e3);
+            if (self != 0)
+            {
+                file << path << ' ' << self << '\n';
+            }
+
+            write_folded(file, child, path);
+        }
+    }
+
+    void GlobalProfiler::folded(string const &filename) const
+    {
+        const profiler_section_t section;
+        ofstream file(filename, ios::trunc);
+        write_folded(file, call_tree(), "");
+    }
+
+    string makeNamePadding(const string& s)
+    {
+        stringstream ss;
+        for (int i = 0; (i + s.length()) < 30; ++i)
+        {
+            ss << ' ';
+        }
+
+        return ss.str();
+    }
+
+    static void write_counters(ofstream &file, const GlobalProfiler::counters_t &counters)
+    {
+        using Counter = GlobalProfiler::counter_t;
+
+        const auto per = [](const u64 value, const u64 calls)
+        {
+            return static_cast<double>(value) / static_cast<double>(calls);
+        };
+
+        if (const u64 calls = counters.hardware_calls; calls != 0)
+        {
+            file <<
+                ",   IPC = " << per(counters.values[Counter::INSTRUCTIONS], std::max<u64>(counters.values[Counter::CYCLES], 1)) <<
+                ", Cache-misses/call = "  << per(counters.values[Counter::CACHE_MISSES], calls) <<
+                ", Branch-misses/call = " << per(counters.values[Counter::BRANCH_MISSES], calls);
+        }
+
+        if (const u64 calls = counters.software_calls; calls != 0)
+        {
+            file <<
+                ",   Task-clock/call = " << per(counters.values[Counter::TASK_CLOCK], calls) / 1e6 << " ms" <<
+                ", Page-faults/call = "  << per(counters.values[Counter::PAGE_FAULTS], calls);
+        }
+    }
+
+    static void write_stats(ofstream &file, const map<string, ProfilerStats> &stats,
+        const map<string, GlobalProfiler::counters_t> &counters = {}, const map<string, GlobalProfiler::allocations_t> &allocations = {})
+    {
+        for (const auto & [fst, snd] : stats)
+        {
+            file <<
+                fst << makeNamePadding(fst) <<
+                ": Mean = " << snd.mean()   << " ms, " << /* makeDoublePadding(pair.second.mean())   << */
+                "Stddev = " << snd.stddev() << " ms, " << /* makeDoublePadding(pair.second.stddev()) << */
+                "   Min = " << snd.min()    << " ms, " << /* makeDoublePadding(pair.second.min())    << */
+                "   Max = " << snd.max()    << " ms, " << /* makeDoublePadding(pair.second.max())    << */
+                "   p50 = " << snd.percentile(0.50)  << " ms, " <<
+                "   p90 = " << snd.percentile(0.90)  << " ms, " <<
+                "   p99 = " << snd.percentile(0.99)  << " ms, " <<
+                " p99.9 = " << snd.percentile(0.999) << " ms, " <<
+                " Count = " << snd.count();           /* makeDoublePadding(pair.second.count())  << */
+
+            if (const auto it = counters.find(fst); it != counters.end())
+            {
+                write_counters(file, it->second);
+            }
+
+            if (const auto it = allocations.find(fst); it != allocations.end() && it->second.calls != 0)
+            {
+                const auto calls = static_cast<double>(it->second.calls);
+                file <<
+                    ",   Allocs/call = " << static_cast<double>(it->second.count) / calls <<
+                    ", Bytes/call = "    << static_cast<double>(it->second.bytes) / calls;
+            }
+
+            file << "\n";
+        }
+    }
+
+    void GlobalProfiler::report(string const &filename) const
+    {
+        const profiler_section_t section;
+        const map<string, ProfilerStats> stats = merged();
+
+        char time[TIME::MILI_LEN];
+        TIME::mili(time, chrono::system_clock::now());
+
+        ofstream file(filename, ios::app);
+        file << "\n\nProfiling report: ";
+        file.write(time, TIME::MILI_LEN) << '\n';
+        write_stats(file, stats, merged_counters(), merged_allocations());
+
+        const call_tree_t tree = call_tree();
+        file << "\nCall tree:\n";
+        write_call_tree(file, tree, 0);
+        file.close();
+
+        ofstream folded_file(filename + ".folded", ios::trunc);
+        write_folded(folded_file, tree, "");
+        folded_file.close();
+
+        if (sample_next.load() != 0)
+        {
+            folded_samples(filename + ".samples.folded");
+        }
+    }
+
+    void GlobalProfiler::set_counters(const bool enable)
+    {
+        counting.store(enable);
+    }
+
+    static int open_counter(const u32 type, const u64 config, const int group)
+    {
+        perf_event_attr attr{};
+        attr.size           = sizeof(attr);
+        attr.type           = type;
+        attr.config         = config;
+        attr.read_format    = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;   /* Allowed with the default perf_event_paranoid of 2 */
+        attr.exclude_hv     = 1;
+
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    /* Closes the calling thread's counters when it exits, its shard stays */
+    typedef struct counter_fds_t {
+        vector<int> fds;
+
+        ~counter_fds_t()
+        {
+            for (const int fd : fds)
+            {
+                ::close(fd);
+            }
+        }
+    } counter_fds_t;
+
+    void GlobalProfiler::open_counters(shard_t &shard)
+    {
+        thread_local counter_fds_t owned;
+
+        const auto open_group = [](const vector<pair<u32, u64>> &events)
+        {
+            vector<int> fds;
+            for (const auto &[type, config] : events)
+            {
+                const int fd = open_counter(type, config, fds.empty() ? -1 : fds.front());
+                if (fd < 0)
+                {
+                    for (const int open : fds)
+                    {
+                        ::close(open);
+                    }
+
+                    return vector<int>();
+                }
+
+                fds.push_back(fd);
+            }
+
+            return fds;
+        };
+
+        vector<int> fds = open_group({
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES}
+        });
+        shard.counter_source = COUNTERS_HARDWARE;
+
+        if (fds.empty())
+        {
+            /* No PMU, e.g. in most VMs and containers */
+            fds = open_group({
+                {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+                {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+            });
+            shard.counter_source = COUNTERS_SOFTWARE;
+        }
+
+        if (fds.empty())
+        {
+            shard.counter_source = COUNTERS_NONE;
+            return;
+        }
+
+        shard.counter_fd = fds.front();
+        owned.fds.insert(owned.fds.end(), fds.begin(), fds.end());
+    }
+
+    /* Fills all of 'values', the counters this thread does not have read as zero */
+    bool GlobalProfiler::read_counters(const shard_t &shard, u64 *values)
+    {
+        if (shard.counter_fd < 0)
+        {
+            return false;
+        }
+
+        u64 group[1 + 4];   /* nr, then one value per counter in opening order */
+        if (::read(shard.counter_fd, group, sizeof(group)) < static_cast<ssize_t>(sizeof(u64)))
+        {
+            return false;
+        }
+
+        fill_n(values, COUNTER_COUNT, 0);
+        const u32 first = shard.counter_source == COUNTERS_HARDWARE ? CYCLES : TASK_CLOCK;
+        for (u64 i = 0; i < group[0] && i < 4; ++i)
+        {
+            values[first + i] = group[1 + i];
+        }
+
+        return true;
+    }
+
+    map<string, GlobalProfiler::counters_t> GlobalProfiler::merged_counters() const
+    {
+        const profiler_section_t section;
+        map<string, counters_t> counters;
+
+        lock_guard<mutex> guard(shards_mutex);
+        lock_guard<mutex> names_guard(names_mutex);
+        for (const auto &shard : shards)
+        {
+            lock_guard<mutex> shard_guard(shard->lock);
+            for (u32 id = 0; id < shard->counters.size(); ++id)
+            {
+                counters_t from;
+                read_stable(shard->seq, [&] { from = shard->counters[id]; });
+                if (from.hardware_calls + from.software_calls == 0)
+                {
+                    continue;
+                }
+
+                counters_t &into = counters[names[id]];
+                into.hardware_calls += from.hardware_calls;
+                into.software_calls += from.software_calls;
+                for (u32 i = 0; i < COUNTER_COUNT; ++i)
+                {
+                    into.values[i] += from.values[i];
+                }
+            }
+        }
+
+        return counters;
+    }
+
+    #ifndef sigev_notify_thread_id
+        #define sigev_notify_thread_id _sigev_un._tid
+    #endif
+
+    /* Handlers running right now, 'start_sampling' waits for none before it reuses the buffer */
+    static atomic<u32> sample_handlers{0};
+
+    /* The run every armed timer carries in 'si_value', signals of older timers are dropped */
+    static atomic<u32> sample_run{0};
+
+    static void sample_signal(int, siginfo_t *info, void *)
+    {
+        const int saved = errno;
+        sample_handlers.fetch_add(1);
+
+        sample_t *buffer = samples.load(memory_order_acquire);
+        if (sampling.load() && buffer != nullptr && static_cast<u32>(info->si_value.sival_int) == sample_run.load())
+        {
+            if (const std_size_t slot = sample_next.fetch_add(1, memory_order_relaxed); slot < sample_capacity.load(memory_order_relaxed))
+            {
+                void *frames[SAMPLE_DEPTH + 2];
+                const int depth = backtrace(frames, SAMPLE_DEPTH + 2);
+
+                /* Leaves out this handler and the signal trampoline */
+                const int skip = std::min(depth, 2);
+                copy(frames + skip, frames + depth, buffer[slot].frames);
+                buffer[slot].depth.store(static_cast<u32>(depth - skip), memory_order_release);
+            }
+        }
+
+        sample_handlers.fetch_sub(1);
+        errno = saved;
+    }
+
+    /*
+     *
+     * Every armed timer by the thread it samples, so 'stop_sampling' can delete all of them.
+     * Never destroyed, threads may exit after static destructors.
+     *
+     */
+    static mutex &sample_timers_mutex = *new mutex;
+    static map<pid_t, timer_t> &sample_timers = *new map<pid_t, timer_t>;
+
+    static void disarm_sample_timer(const pid_t tid)
+    {
+        lock_guard<mutex> guard(sample_timers_mutex);
+        if (const auto it = sample_timers.find(tid); it != sample_timers.end())
+        {
+            timer_delete(it->second);
+            sample_timers.erase(it);
+        }
+    }
+
+    /* The CPU time clock of any thread of this process, built like glibc does for 'pthread_getcpuclockid' */
+    static clockid_t thread_cpu_clock(const pid_t tid)
+    {
+        return static_cast<clockid_t>((~static_cast<u32>(tid) << 3) | 6);
+    }
+
+    /* Counts the thread's CPU time, so idle threads cost nothing */
+    static void arm_sample_timer(const pid_t tid, const u32 run, const chrono::microseconds period)
+    {
+        sigevent event{};
+        event.sigev_notify           = SIGEV_THREAD_ID;
+        event.sigev_signo            = SIGPROF;
+        event.sigev_notify_thread_id = tid;
+        event.sigev_value.sival_int  = static_cast<int>(run);
+
+        /* Fails for a thread that exited since it was listed */
+        timer_t timer;
+        if (timer_create(thread_cpu_clock(tid), &event, &timer) != 0)
+        {
+            return;
+        }
+
+        const auto ns = chrono::duration_cast<chrono::nanoseconds>(period).count();
+        itimerspec spec{};
+        spec.it_interval.tv_sec  = static_cast<time_t>(ns / 1'000'000'000);
+        spec.it_interval.tv_nsec = static_cast<long>(ns % 1'000'000'000);
+        spec.it_value            = spec.it_interval;
+        timer_settime(timer, 0, &spec, nullptr);
+
+        lock_guard<mutex> guard(sample_timers_mutex);
+        if (const auto [it, added] = sample_timers.try_emplace(tid, timer); !added)
+        {
+            timer_delete(it->second);
+            it->second = timer;
+        }
+    }
+
+    /* Deletes the calling thread's timer when it exits, threads only armed by 'start_sampling' keep theirs until 'stop_sampling' */
+    typedef struct sample_timer_owner_t {
+        ~sample_timer_owner_t()
+        {
+            disarm_sample_timer(static_cast<pid_t>(gettid()));
+        }
+    } sample_timer_owner_t;
+
+    void GlobalProfiler::start_sampling(const chrono::microseconds period, const std_size_t capacity)
+    {
+        const profiler_section_t section;
+        stop_sampling();
+
+        unique_lock<mutex> guard(sampling_mutex);
+
+        /*
+         *
+         * Every timer is deleted by now and signals they still had queued carry an older run,
+         * what is left are handlers that were already past that check when sampling stopped.
+         *
+         */
+        while (sample_handlers.load() != 0)
+        {
+            this_thread::yield();
+        }
+
+        if (samples.load() == nullptr || sample_capacity.load() < capacity)
+        {
+            /* The old buffer leaks on purpose, see above */
+            samples.store(new sample_t[capacity]{}, memory_order_release);
+            sample_capacity.store(capacity);
+        }
+        else
+        {
+            for (std_size_t i = 0; i < sample_capacity.load(); ++i)
+            {
+                samples.load()[i].depth.store(0);
+            }
+        }
+
+        sample_next.store(0);
+        sampling_period = period;
+
+        /* The first call may load libgcc, which must not happen inside the handler */
+        void *warm[1];
+        backtrace(warm, 1);
+
+        struct sigaction action{};
+        action.sa_sigaction = sample_signal;
+        action.sa_flags     = SA_RESTART | SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGPROF, &action, &previous_prof);
+
+        const u32 run = sampling_generation.fetch_add(1) + 1;
+        sample_run.store(run);
+        sampling.store(true);
+
+        /* Every thread there is now, later ones arm on their first scope or through 'sample_thread' */
+        if (DIR *tasks = opendir("/proc/self/task"); tasks != nullptr)
+        {
+            while (const dirent *task = readdir(tasks))
+            {
+                if (const auto tid = static_cast<pid_t>(strtol(task->d_name, nullptr, 10)); tid > 0)
+                {
+                    arm_sample_timer(tid, run, period);
+                }
+            }
+
+            closedir(tasks);
+        }
+
+        guard.unlock();
+        sample_thread();
+    }
+
+    void GlobalProfiler::stop_sampling()
+    {
+        lock_guard<mutex> guard(sampling_mutex);
+        if (!sampling.load())
+        {
+            return;
+        }
+
+        sampling.store(false);
+        sampling_generation.fetch_add(1);
+        {
+            lock_guard<mutex> timers_guard(sample_timers_mutex);
+            for (const auto &[tid, timer] : sample_timers)
+            {
+                timer_delete(timer);
+            }
+
+            sample_timers.clear();
+        }
+
+        /*
+         *
+         * A signal of a deleted timer may still be queued for some thread. SIGPROF kills
+         * the process by default, so a default action is restored as ignored instead.
+         *
+         */
+        struct sigaction previous = previous_prof;
+        if (previous.sa_handler == SIG_DFL && (previous.sa_flags & SA_SIGINFO) == 0)
+        {
+            previous.sa_handler = SIG_IGN;
+        }
+
+        sigaction(SIGPROF, &previous, nullptr);
+    }
+
+    void GlobalProfiler::sample_thread()
+    {
+        const profiler_section_t section;
+        shard_t &shard = local_shard();
+        const auto tid = static_cast<pid_t>(gettid());
+
+        lock_guard<mutex> guard(sampling_mutex);
+        shard.sample_generation = sampling_generation.load();
+        disarm_sample_timer(tid);
+
+        if (!sampling.load())
+        {
+            return;
+        }
+
+        static thread_local sample_timer_owner_t owner;
+        (void)owner;
+        arm_sample_timer(tid, sample_run.load(), sampling_period);
+    }
+
+    static string symbolize(void *frame, map<void *, string> &cache)
+    {
+        if (const auto it = cache.find(frame); it != cache.end())
+        {
+            return it->second;
+        }
+
+        string name;
+        Dl_info info{};
+        if (dladdr(frame, &info) != 0 && info.dli_sname != nullptr)
+        {
+            int status;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            name = status == 0 ? demangled : info.dli_sname;
+            free(demangled);
+        }
+        else if (info.dli_fname != nullptr)
+        {
+            /* Not exported, link with -rdynamic to get a name */
+            const char *base = strrchr(info.dli_fname, '/');
+            char offset[32];
+            snprintf(offset, sizeof(offset), "+0x%zx", static_cast<size_t>(static_cast<char *>(frame) - static_cast<char *>(info.dli_fbase)));
+            name = string(base != nullptr ? base + 1 : info.dli_fname) + offset;
+        }
+        else
+        {
+            char address[32];
+            snprintf(address, sizeof(address), "%p", frame);
+            name = address;
+        }
+
+        /* ';' separates frames in the folded format */
+        replace(name.begin(), name.end(), ';', ':');
+        return cache[frame] = name;
+    }
+
+    void GlobalProfiler::folded_samples(string const &filename) const
+    {
+        const profiler_section_t section;
+        lock_guard<mutex> guard(sampling_mutex);
+        const sample_t *buffer = samples.load(memory_order_acquire);
+        if (buffer == nullptr)
+        {
+            return;
+        }
+
+        map<vector<void *>, u64> stacks;
+        const std_size_t taken = std::min(sample_next.load(), sample_capacity.load());
+        for (std_size_t i = 0; i < taken; ++i)
+        {
+            if (const u32 depth = buffer[i].depth.load(memory_order_acquire); depth != 0)
+            {
+                ++stacks[vector<void *>(buffer[i].frames, buffer[i].frames + depth)];
+            }
+        }
+
+        map<void *, string> symbols;
+        map<string, u64> folded;
+        for (const auto &[frames, count] : stacks)
+        {
+            /* Outermost frame first */
+            string line;
+            for (auto it = frames.rbegin(); it != frames.rend(); ++it)
+            {
+                if (!line.empty())
+                {
+                    line += ';';
+                }
+
+                line += symbolize(*it, symbols);
+            }
+
+            folded[line] += count;
+        }
+
+        ofstream file(filename, ios::trunc);
+        for (const auto &[line, count] : folded)
+        {
+            file << line << ' ' << count << '\n';
+        }
+
+        if (sample_next.load() > taken)
+        {
+            file << "[dropped] " << sample_next.load() - taken << '\n';
+        }
+    }
+
+    void GlobalProfiler::set_allocations(const bool enable)
+    {
+        tracking_allocations.store(enable);
+    }
+
+    void GlobalProfiler::allocated(const std_size_t bytes)
+    {
+        shard_t *shard = thread_shard;
+        if (!tracking_allocations.load(memory_order_relaxed) || inside_profiler != 0 || shard == nullptr || shard->current == 0)
+        {
+            return;
+        }
+
+        /* Never called from inside a write, see 'inside_profiler' */
+        call_node_t &call = shard->nodes[shard->current];
+        begin_write(*shard);
+        ++call.allocations;
+        call.allocated_bytes += bytes;
+        end_write(*shard);
+    }
+
+    map<string, GlobalProfiler::allocations_t> GlobalProfiler::merged_allocations() const
+    {
+        const profiler_section_t section;
+        map<string, allocations_t> allocations;
+
+        lock_guard<mutex> guard(shards_mutex);
+        lock_guard<mutex> names_guard(names_mutex);
+        for (const auto &shard : shards)
+        {
+            lock_guard<mutex> shard_guard(shard->lock);
+            for (u32 node = 1; node < shard->nodes.size(); ++node)
+            {
+                const call_node_t &call = shard->nodes[node];
+
+                /* Calls on paths that did not allocate still count, or the per call figures come out too high */
+                allocations_t from;
+                read_stable(shard->seq, [&] { from = {call.calls, call.allocations, call.allocated_bytes}; });
+
+                allocations_t &into = allocations[names[call.id]];
+                into.calls += from.calls;
+                into.count += from.count;
+                into.bytes += from.bytes;
+            }
+        }
+
+        erase_if(allocations, [](const auto &entry) { return entry.second.count == 0; });
+        return allocations;
+    }
+
+    void GlobalProfiler::set_tracing(const bool enable, const std_size_t capacity)
+    {
+        if (enable)
+        {
+            trace_capacity.store(capacity);
+            if (trace_origin.load() == 0)
+            {
+                trace_origin.store(ProfilerClock::now());
+            }
+        }
+
+        tracing.store(enable);
+    }
+
+    static void trace_string(ofstream &file, string const &str)
+    {
+        file << '"';
+        for (const char c : str)
+        {
+            if (c == '"' || c == '\\')
+            {
+                file << '\\' << c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                file << esc;
+            }
+            else
+            {
+                file << c;
+            }
+        }
+
+        file << '"';
+    }
+
+    void GlobalProfiler::trace(string const &filename)
+    {
+        const profiler_section_t section;
+
+        /* Take the buffers out first, recording threads never wait for it */
+        vector<thread_trace_t> threads;
+        vector<string> scope_names;
+        {
+            lock_guard<mutex> guard(shards_mutex);
+            threads.swap(exited_traces);
+            exited_events = 0;
+
+            const std_size_t capacity = trace_capacity.load();
+            for (const auto &shard : shards)
+            {
+                if (shard.get() == exited)
+                {
+                    continue;
+                }
+
+                lock_guard<mutex> shard_guard(shard->lock);
+                flip(*shard, capacity);
+                threads.push_back({shard->tid, shard->thread_name, {}, shard->dropped});
+                threads.back().events.swap(shard->events);
+                shard->dropped = 0;
+            }
+
+            lock_guard<mutex> names_guard(names_mutex);
+            scope_names = names;
+        }
+
+        const u64 origin = trace_origin.load();
+        const auto us = [origin](const u64 ticks)
+        {
+            return ProfilerClock::to_ms(static_cast<double>(static_cast<i64>(ticks - origin))) * 1e3;
+        };
+
+        ofstream file(filename, ios::trunc);
+        file.precision(3);
+        file << fixed << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        const i32 pid = getpid();
+        bool first = true;
+        for (const auto &thread : threads)
+        {
+            file << (first ? "\n" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+                 << ",\"tid\":" << thread.tid << ",\"args\":{\"name\":";
+            trace_string(file, thread.name);
+            file << ",\"dropped\":" << thread.dropped << "}}";
+            first = false;
+
+            /* Complete events, a viewer nests them by their extent on the same thread */
+            for (const auto &event : thread.events)
+            {
+                file << ",\n{\"ph\":\"X\",\"cat\":\"nxlib\",\"name\":";
+                trace_string(file, scope_names[event.id]);
+                file << ",\"pid\":" << pid << ",\"tid\":" << thread.tid
+                     << ",\"ts\":" << us(event.begin) << ",\"dur\":" << us(event.end) - us(event.begin) << '}';
+            }
+        }
+
+        file << "\n]}\n";
+    }
+
+    /* Written to from the SIGUSR1 handler, 'write' is async-signal-safe */
+    static atomic<int> snapshot_signal_fd{-1};
+
+    static void snapshot_signal(int)
+    {
+        const int  saved = errno;
+        const char wake  = 's';
+        (void)!::write(snapshot_signal_fd.load(), &wake, 1);
+        errno = saved;
+    }
+
+    void GlobalProfiler::start_snapshots(string const &filename, const chrono::milliseconds interval)
+    {
+        const profiler_section_t section;
+        stop_snapshots();
+        if (pipe2(snapshot_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        {
+            return;
+        }
+
+        snapshot_file     = filename;
+        snapshot_interval = interval;
+        window_start      = chrono::steady_clock::now();
+        snapshot_signal_fd.store(snapshot_pipe[1]);
+
+        struct sigaction action{};
+        action.sa_handler = snapshot_signal;
+        action.sa_flags   = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, &previous_usr1);
+
+        snapshotter = thread([this]
+        {
+            pollfd wake{snapshot_pipe[0], POLLIN, 0};
+            for (;;)
+            {
+                const int timeout = snapshot_interval.count() > 0 ? static_cast<int>(snapshot_interval.count()) : -1;
+                if (poll(&wake, 1, timeout) < 0)
+                {
+                    continue;
+                }
+
+                char    buf[64];
+                ssize_t len;
+                bool    quit = false;
+                while ((len = ::read(snapshot_pipe[0], buf, sizeof(buf))) > 0)
+                {
+                    quit |= memchr(buf, 'q', static_cast<size_t>(len)) != nullptr;
+                }
+
+                if (quit)
+                {
+                    return;
+                }
+
+                snapshot();
+            }
+        });
+    }
+
+    void GlobalProfiler::stop_snapshots()
+    {
+        if (!snapshotter.joinable())
+        {
+            return;
+        }
+
+        sigaction(SIGUSR1, &previous_usr1, nullptr);
+        snapshot_signal_fd.store(-1);
+
+        const char quit = 'q';
+        (void)!::write(snapshot_pipe[1], &quit, 1);
+        snapshotter.join();
+
+        ::close(snapshot_pipe[0]);
+        ::close(snapshot_pipe[1]);
+        snapshot_pipe[0] = snapshot_pipe[1] = -1;
+    }
+
+    string GlobalProfiler::snapshot_path() const
+    {
+        return snapshot_file.empty() ? "profiling_report.txt" : snapshot_file;
+    }
+
+    void GlobalProfiler::snapshot()
+    {
+        const profiler_section_t section;
+        map<string, ProfilerStats> window;
+        map<string, ProfilerStats> cumulative;
+        double seconds;
+        {
+            lock_guard<mutex> snapshot_guard(snapshot_mutex);
+
+            /* Flip and swap under the shard lock, merge after releasing it */
+            vector<vector<ProfilerStats>> taken;
+            {
+                lock_guard<mutex> guard(shards_mutex);
+                const std_size_t capacity = trace_capacity.load();
+                for (const auto &shard : shards)
+                {
+                    lock_guard<mutex> shard_guard(shard->lock);
+                    flip(*shard, capacity);
+                    taken.emplace_back().swap(shard->stats);
+                }
+            }
+
+            {
+                lock_guard<mutex> names_guard(names_mutex);
+                for (const auto &stats : taken)
+                {
+                    for (u32 id = 0; id < stats.size(); ++id)
+                    {
+                        if (stats[id].count() != 0)
+                        {
+                            window[names[id]].merge(stats[id]);
+                        }
+                    }
+                }
+            }
+
+            for (const auto &[name, stats] : window)
+            {
+                retired[name].merge(stats);
+            }
+
+            cumulative = retired;
+
+            const auto now = chrono::steady_clock::now();
+            seconds        = chrono::duration<double>(now - window_start).count();
+            window_start   = now;
+        }
+
+        char time[TIME::MILI_LEN];
+        TIME::mili(time, chrono::system_clock::now());
+
+        ofstream file(snapshot_file, ios::app);
+        file << "\n\nProfiling snapshot: ";
+        file.write(time, TIME::MILI_LEN) << ", last " << seconds << " s\n";
+        write_stats(file, window);
+        file << "\nCumulative:\n";
+        write_stats(file, cumulative, merged_counters(), merged_allocations());
+    }
+
+    void init_gProf()
+    {
+        GlobalProfiler::instance();
+    }
+
+    /*********************************************************************
+    *****************<<            AutoTimer          >>******************
+    *********************************************************************/
+
+    ProfilerScope::ProfilerScope(string const &name)
+    : id(GlobalProfiler::instance().intern(name))
+    {}
+
+    AutoTimer::AutoTimer(string const &name)
+    : id(GlobalProfiler::instance().id_of(name)), node(GlobalProfiler::instance().enter(id)), start(ProfilerClock::now())
+    {}
+
+    AutoTimer::AutoTimer(const ProfilerScope &scope)
+    : id(scope.id), node(GlobalProfiler::instance().enter(id)), start(ProfilerClock::now())
+    {}
+
+    AutoTimer::~AutoTimer()
+    {
+        GlobalProfiler::instance().leave(node, start, ProfilerClock::now());
+    }
+
+    /* Register at-exit handler to generate the report */
+    void setupReportGeneration()
+    {
+        atexit([]
+        {
+            GlobalProfiler &profiler = GlobalProfiler::instance();
+            profiler.report(profiler.snapshot_path());
+        });
+    }
+} // NXlib
+
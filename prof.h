@@ -66,53 +66,535 @@
 
 #include "globals.h"
 
+#include <atomic>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
 
 using namespace std;
 
 
 namespace NXlib
 {
+    /**
+     *
+     * @brief Time source of the profiler, steady_clock nanoseconds or raw TSC ticks.
+     *
+     * Samples are kept in ticks and only turned into ms for a report. Pick the
+     * source before the first scope is timed, a sample spanning a switch is garbage.
+     *
+     */
+    class ProfilerClock
+    {
+    public:
+        typedef enum : u8 {
+            STEADY = 0,
+            TSC    = 1
+        } source_t;
+
+        /**
+         *
+         * @brief Switches to 'source', calibrating the TSC against CLOCK_MONOTONIC_RAW.
+         *
+         * Returns false and stays on 'STEADY' when the TSC is not invariant
+         * or rdtscp is missing, the TSC would not be a usable clock then.
+         *
+         */
+        static bool set_source(source_t source);
+        [[nodiscard]] static source_t source();
+
+        static u64 now()
+        {
+        #if defined(__x86_64__) || defined(__i386__)
+            if (tsc.load(memory_order_relaxed))
+            {
+                /* rdtscp waits for earlier instructions, so the scope body is not cut short */
+                unsigned aux;
+                return __rdtscp(&aux);
+            }
+        #endif
+
+            return static_cast<u64>(chrono::steady_clock::now().time_since_epoch().count());
+        }
+
+        [[nodiscard]] static double to_ms(double ticks);
+        [[nodiscard]] static u64 from_ms(double ms);
+
+    private:
+        inline static atomic<bool> tsc{false};
+        inline static atomic<double> ms_per_tick{1e-6};
+    };
+
+    /**
+     *
+     * @brief Running statistics of one scope with bounded memory.
+     *
+     * Samples are 'ProfilerClock' ticks, every accessor returns ms.
+     * Mean and stddev are Welford running moments. Percentiles come from a log-linear
+     * histogram over ticks, 32 buckets per power of two, so a percentile is off
+     * by at most about 3%. Buckets are only allocated up to the largest value seen.
+     *
+     */
     class ProfilerStats
     {
     public:
-        void record(double value);
+        /**
+         * @brief Records 'ms' milliseconds, converted to ticks of the current 'ProfilerClock'.
+         */
+        void record(double ms);
+
+        /**
+         * @brief Records 'ticks' of 'ProfilerClock', what the profiler itself measures in.
+         */
+        void record_ticks(u64 ticks);
+
         [[nodiscard]] double mean() const;
         [[nodiscard]] double stddev() const;
         [[nodiscard]] double min() const;
         [[nodiscard]] double max() const;
         [[nodiscard]] std_size_t count() const;
 
+        /**
+         * @brief Value below which 'p' (0 to 1) of the samples fall.
+         */
+        [[nodiscard]] double percentile(double p) const;
+
+        /**
+         * @brief Folds 'other' in as if its samples had been recorded here.
+         */
+        void merge(const ProfilerStats &other);
+
+        static constexpr u32 SUB_BUCKET_BITS = 5;
+        static constexpr u32 SUB_BUCKETS     = 1 << SUB_BUCKET_BITS;
+
     private:
-        vector<double> values;
+        [[nodiscard]] static u32 bucket_of(u64 ticks);
+        [[nodiscard]] static double bucket_value(u32 bucket);
+
+        std_size_t n = 0;
+        double m1 = 0.0;
+        double m2 = 0.0;
+        u64 lowest = 0;
+        u64 highest = 0;
+        vector<u64> buckets;
     };
 
+    /**
+     *
+     * @brief The one profiler of the process, every thread records into its own shard.
+     *
+     * A shard is only written by its own thread, without a lock, so recording threads
+     * never wait on each other or on a reader. Readers take the stats by flipping the
+     * shard to its other window, see 'flip'. When a thread exits its shard is merged
+     * into one shared by all exited threads and freed, see 'retire'.
+     *
+     */
     class GlobalProfiler
     {
     public:
+        static GlobalProfiler& instance();
+
+        /**
+         * @brief Id of the scope called 'name', the same name always gets the same id.
+         */
+        u32 intern(string const &name);
+
+        /**
+         * @brief Like 'intern' but looks in the calling thread's cache first, no lock on a hit.
+         */
+        u32 id_of(string const &name);
+
+        /**
+         * @brief Records 'duration' ms under scope 'id'.
+         */
+        void record(u32 id, double duration);
+
+        /**
+         * @brief Records 'ticks' of 'ProfilerClock' under scope 'id'.
+         */
+        void record_ticks(u32 id, u64 ticks);
+
+        /**
+         * @brief Records the span from 'begin' to 'end' ticks, also as a trace event while tracing.
+         */
+        void record(u32 id, u64 begin, u64 end);
+
+        /**
+         * @brief Pushes scope 'id' on the calling thread's scope stack, returns its call tree node.
+         */
+        u32 enter(u32 id);
+
+        /**
+         * @brief Pops 'node' off the scope stack and records its span like 'record'.
+         */
+        void leave(u32 node, u64 begin, u64 end);
+
+        /**
+         * @brief Records 'duration' ms under 'name'.
+         */
         void record(string const &name, double duration);
         void report(string const &filename) const;
-        static GlobalProfiler* createNewGprof();
+
+        /**
+         * @brief The stats of all shards, merged by name.
+         */
+        [[nodiscard]] map<string, ProfilerStats> merged() const;
+
+        /**
+         *
+         * @brief Appends a snapshot to 'filename' every 'interval' and on SIGUSR1.
+         *
+         * A snapshot holds the stats of the window since the previous one and the
+         * cumulative totals. It is taken by flipping each shard to its other window,
+         * recording threads never wait for it. An 'interval' of zero only snapshots
+         * on SIGUSR1.
+         *
+         */
+        void start_snapshots(string const &filename, chrono::milliseconds interval);
+
+        /**
+         * @brief Stops the snapshots and gives SIGUSR1 back to the handler it had before.
+         */
+        void stop_snapshots();
+
+        /**
+         * @brief The file last passed to 'start_snapshots', 'profiling_report.txt' if none was.
+         */
+        [[nodiscard]] string snapshot_path() const;
+
+        /**
+         * @brief Takes one snapshot now, 'start_snapshots' must have been called.
+         */
+        void snapshot();
+
+        /**
+         *
+         * @brief Counts CPU events per scope with 'perf_event_open', see 'counters_t'.
+         *
+         * Each thread opens its counters on its first scope after this. Without a usable
+         * PMU it falls back to the software task-clock and page-faults counters. Costs a
+         * read syscall on entering and on leaving every scope, so keep it off by default.
+         *
+         */
+        void set_counters(bool enable);
+
+        typedef enum : u8 {
+            CYCLES        = 0,
+            INSTRUCTIONS  = 1,
+            CACHE_MISSES  = 2,
+            BRANCH_MISSES = 3,
+            TASK_CLOCK    = 4,   /* ns */
+            PAGE_FAULTS   = 5,
+            COUNTER_COUNT = 6
+        } counter_t;
+
+        /**
+         * @brief Counter deltas of one scope, the hardware and software sets have their own call counts.
+         */
+        typedef struct counters_t {
+            u64 hardware_calls = 0;
+            u64 software_calls = 0;
+            u64 values[COUNTER_COUNT] = {};
+        } counters_t;
+
+        [[nodiscard]] map<string, counters_t> merged_counters() const;
+
+        /**
+         *
+         * @brief Samples the stack of every profiled thread each 'period' of its CPU time.
+         *
+         * Each thread gets its own SIGPROF timer, armed here for every thread the process
+         * has, scopes or not. Threads started later are armed on their first scope, one
+         * that never opens a scope is only sampled after it calls 'sample_thread'. The
+         * handler only copies 'backtrace' into a preallocated buffer of 'capacity' samples,
+         * symbols are resolved when the samples are written. Restarting waits for running
+         * handlers and drops signals of the previous run before the buffer is reused.
+         * CPU time timers fire on scheduler ticks, shorter periods than a tick do not help.
+         *
+         */
+        void start_sampling(chrono::microseconds period = chrono::milliseconds(1), std_size_t capacity = 1 << 16);
+
+        /**
+         * @brief Deletes the timers of all threads and gives SIGPROF back to the handler it had before.
+         */
+        void stop_sampling();
+
+        /**
+         *
+         * @brief Arms the sampling timer of the calling thread, a no op when not sampling.
+         *
+         * Only needed by threads started after 'start_sampling' that never open a scope.
+         *
+         */
+        void sample_thread();
+
+        /**
+         * @brief Writes the samples to 'filename' as folded stacks, one count per distinct stack.
+         */
+        void folded_samples(string const &filename) const;
+
+        /**
+         *
+         * @brief Counts every 'operator new' against the innermost open scope of its thread.
+         *
+         * Only has an effect when NXlib is built with NXLIB_PROFILE_ALLOCATIONS, which
+         * replaces the global 'operator new' and 'operator delete'. Allocations outside of
+         * any scope, or on threads that never opened one, are not counted.
+         *
+         */
+        static void set_allocations(bool enable);
+
+        /**
+         * @brief Called by the replaced 'operator new', see 'set_allocations'.
+         */
+        static void allocated(std_size_t bytes);
+
+        /**
+         * @brief Allocations made directly inside one scope, nested scopes count their own.
+         */
+        typedef struct allocations_t {
+            u64 calls = 0;
+            u64 count = 0;
+            u64 bytes = 0;
+        } allocations_t;
+
+        [[nodiscard]] map<string, allocations_t> merged_allocations() const;
+
+        /**
+         *
+         * @brief One path of nested scopes, merged over all threads.
+         *
+         * 'total' is inclusive, 'child' the part of it spent in nested scopes, both in ticks.
+         * The root has no name and only holds the outermost scopes.
+         *
+         */
+        typedef struct call_tree_t {
+            string name;
+            u64 calls = 0;
+            u64 total = 0;
+            u64 child = 0;
+            vector<call_tree_t> children;
+        } call_tree_t;
+
+        [[nodiscard]] call_tree_t call_tree() const;
+
+        /**
+         * @brief Writes the call tree to 'filename' as folded stacks, self time in µs.
+         */
+        void folded(string const &filename) const;
+
+        /**
+         *
+         * @brief Starts or stops keeping every timed scope as a trace event.
+         *
+         * Each thread buffers at most 'capacity' events, later ones are dropped
+         * and counted until 'trace' empties the buffers again.
+         *
+         */
+        void set_tracing(bool enable, std_size_t capacity = 1 << 20);
+
+        /**
+         *
+         * @brief Writes the buffered events to 'filename' as Chrome Trace Event JSON and clears them.
+         *
+         * The file opens in chrome://tracing or Perfetto, one track per thread.
+         *
+         */
+        void trace(string const &filename);
 
     private:
-        map<string, ProfilerStats> stats;
+        typedef struct trace_event_t {
+            u32 id;
+            u64 begin;
+            u64 end;
+        } trace_event_t;
+
+        typedef struct call_node_t {
+            u32 id;
+            u32 parent;
+            vector<u32> children;
+            u64 calls = 0;
+            u64 total = 0;
+            u64 child = 0;
+            bool counting = false;
+            u64 counter_start[COUNTER_COUNT] = {};
+            u64 allocations = 0;
+            u64 allocated_bytes = 0;
+        } call_node_t;
+
+        typedef enum : u8 {
+            COUNTERS_UNTRIED = 0,
+            COUNTERS_NONE,
+            COUNTERS_HARDWARE,
+            COUNTERS_SOFTWARE
+        } counter_source_t;
+
+        /* What the owning thread records into, see 'flip' */
+        typedef struct window_t {
+            vector<ProfilerStats> stats;   /* Indexed by scope id */
+            vector<trace_event_t> events;
+            std_size_t dropped = 0;
+        } window_t;
+
+        typedef struct shard_t {
+            mutex lock;                    /* Held by readers, and by the owning thread to add nodes or counters */
+            atomic<u32> seq{0};            /* Odd while the owning thread writes, see 'begin_write' */
+            atomic<u32> active{0};
+            window_t windows[2];           /* Only 'windows[active]' is written */
+            vector<ProfilerStats> stats;   /* Indexed by scope id, flipped out since the last snapshot */
+            map<string, u32> ids;          /* Cache for 'id_of', only used by the owning thread */
+            vector<call_node_t> nodes{{.id = UINT32_MAX, .parent = 0, .children = {}}};   /* Node 0 is the root */
+            u32 current = 0;               /* Innermost open scope, only used by the owning thread */
+            i32 tid = 0;
+            string thread_name;
+            vector<trace_event_t> events;  /* Flipped out since the last 'trace' */
+            std_size_t dropped = 0;
+            counter_source_t counter_source = COUNTERS_UNTRIED;
+            int counter_fd = -1;           /* Group leader, one read returns the whole group */
+            vector<counters_t> counters;   /* Indexed by scope id */
+            u32 sample_generation = 0;     /* Last sampling run this thread armed its timer for */
+        } shard_t;
+
+        /* The trace events of one thread */
+        typedef struct thread_trace_t {
+            i32 tid;
+            string name;
+            vector<trace_event_t> events;
+            std_size_t dropped;
+        } thread_trace_t;
+
+        /* Retires the calling thread's shard when the thread exits */
+        typedef struct shard_owner_t {
+            ~shard_owner_t();
+        } shard_owner_t;
+
         GlobalProfiler() = default;
+        shard_t& local_shard();
+
+        /**
+         *
+         * @brief Merges the calling thread's 'shard' into 'exited' and frees it.
+         *
+         * Stats, counters and the call tree are added to the ones of threads that exited
+         * before, trace events are kept per thread until 'trace' takes them.
+         *
+         */
+        void retire(shard_t *shard);
+        static void merge_nodes(const shard_t &from, u32 from_node, shard_t &into, u32 into_node);
+        static void open_counters(shard_t &shard);
+        static bool read_counters(const shard_t &shard, u64 *values);
+
+        /* Null until the thread records its first scope, 'allocated' must not create it */
+        inline static thread_local shard_t *thread_shard = nullptr;
+        void record(window_t &window, u32 id, u64 begin, u64 end);
+
+        /**
+         *
+         * @brief Brackets the owning thread's writes to its shard.
+         *
+         * 'begin_write' makes 'seq' odd and returns the active window, 'end_write' makes
+         * it even again. Nothing in between may take the shard lock, readers hold it
+         * while they wait for an even 'seq'.
+         *
+         */
+        static window_t& begin_write(shard_t &shard);
+        static void end_write(shard_t &shard);
+
+        /**
+         *
+         * @brief Moves the active window's stats and events into the shard's own.
+         *
+         * The owning thread is switched to the other window first, then the old
+         * one is emptied once the thread left it. Caller holds 'shard.lock'.
+         *
+         */
+        static void flip(shard_t &shard, std_size_t capacity);
+
+        mutable mutex shards_mutex;
+        vector<unique_ptr<shard_t>> shards;
+        shard_t *exited = nullptr;              /* In 'shards' once the first thread exited, written under its lock */
+        vector<thread_trace_t> exited_traces;   /* Guarded by 'shards_mutex' */
+        std_size_t exited_events = 0;           /* In 'exited_traces', at most 'trace_capacity' */
+
+        mutable mutex names_mutex;
+        vector<string> names;
+        map<string, u32> ids;
+
+        /* Held while samples move from the shards into 'retired', so no merge sees them twice or never */
+        mutable mutex snapshot_mutex;
+        map<string, ProfilerStats> retired;
+        string snapshot_file;
+        chrono::milliseconds snapshot_interval{0};
+        chrono::steady_clock::time_point window_start;
+        thread snapshotter;
+        int snapshot_pipe[2] = {-1, -1};
+        struct sigaction previous_usr1{};   /* Restored by 'stop_snapshots' */
+
+        atomic<bool> counting{false};
+
+        mutable mutex sampling_mutex;
+        atomic<u32> sampling_generation{0};   /* Odd while sampling */
+        chrono::microseconds sampling_period{0};
+        struct sigaction previous_prof{};   /* Restored by 'stop_sampling' */
+
+        atomic<bool> tracing{false};
+        atomic<std_size_t> trace_capacity{0};
+        atomic<u64> trace_origin{0};
     };
-    static GlobalProfiler* gProf = nullptr;
 
+    /**
+     * @brief A scope name interned once, see 'PROFILE_SCOPE'.
+     */
+    struct ProfilerScope
+    {
+        explicit ProfilerScope(string const &name);
+
+        const u32 id;
+    };
+
+    /**
+     * @brief Creates the profiler up front instead of on the first recorded scope.
+     */
     void init_gProf();
 
     class AutoTimer
     {
     public:
-        explicit AutoTimer(string name);
+        explicit AutoTimer(string const &name);
+        explicit AutoTimer(const ProfilerScope &scope);
         ~AutoTimer();
 
     private:
-        string name;
-        chrono::time_point<chrono::high_resolution_clock> start;
+        u32 id;
+        u32 node;
+        u64 start;
     };
 
-    // Register at-exit handler to generate the report
+    #define PROFILE_CONCAT_(__a, __b) __a##__b
+    #define PROFILE_CONCAT(__a, __b) PROFILE_CONCAT_(__a, __b)
+
+    /**
+     *
+     * @brief Times the rest of the enclosing block as '__name'.
+     *
+     * The name is interned the first time the line runs, after that entering
+     * and leaving the scope is two clock reads, a call tree step and an indexed stats update.
+     *
+     */
+    #define PROFILE_SCOPE(__name) \
+        static const NXlib::ProfilerScope PROFILE_CONCAT(__prof_scope_, __LINE__){__name}; \
+        const NXlib::AutoTimer PROFILE_CONCAT(__prof_timer_, __LINE__){PROFILE_CONCAT(__prof_scope_, __LINE__)}
+
+    #define PROFILE_FUNCTION() \
+        PROFILE_SCOPE(__func__)
+
+    // Register at-exit handler to generate the report, written to 'GlobalProfiler::snapshot_path'
     void setupReportGeneration();
 
     void setupVulkanReportGen();
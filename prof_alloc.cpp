@@ -0,0 +1,135 @@
+/*
+
+    MIT Open Source License
+
+    Copyright (c) 2024 Melwin Svensson
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in (the "Software") without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of (the "Software"), subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of (the "Software").
+
+    Any modifications to (the "Software") must include a prominent notice stating that
+    (the "Software") was created by Melwin Svensson, and that the modifications were made
+    by a different author. The notice must explicitly state that Melwin Svensson created
+    the precursor to the current work, and that (the "Software") has been modified since its
+    original creation. Additionally, a link to the original source code (https://github.com/mellw0101)
+    must be included in a format similar to the following:
+
+    "Melwin Svensson CREATED THE PRECURSOR TO 'the current file' AND IS THE SOLE OWNER AND AUTHOR OF THE PRECURSOR WORK."
+
+    All copies, substantial portions, and derivative works of (the "Software") must be distributed
+    under the exact same license (MIT Open Source License) including all clauses stated in this
+    notice, ensuring that (the "Software") remains free and open source forever.
+
+    Any distribution of (the "Software") in its entirety or in portions, including
+    any derivative works, must retain this license in its entirety and may not be
+    re-licensed under any other license than the same MIT Open Source License.
+    All clauses laid out in this notice must be upheld in all future licenses for (the "Software").
+
+    Any software that includes (the "Software") or any portions of (the "Software") must also be
+    open source and distributed under a license that complies with the Open Source Definition
+    (https://opensource.org/osd).
+
+    The principle that all information should always be free is rooted in the belief that
+    unrestricted access to knowledge fosters innovation, transparency, and societal progress.
+    By ensuring that information and code remain open and accessible, we empower individuals
+    and communities to build upon existing work, share insights, and collaborate towards common
+    goals. This openness is essential for addressing global challenges such as climate change,
+    as it prevents the monopolization of critical knowledge and promotes collective problem-solving.
+    Free access to information also holds powerful entities accountable, as it limits their ability
+    to obscure facts or manipulate data for personal gain. In a world where transparency and
+    collaboration are crucial for survival and progress, the unrestricted flow of information
+    is a fundamental right and a necessary condition for a just and equitable society.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH (the "Software") OR THE USE OR OTHER DEALINGS IN (the "Software").
+
+*/
+
+
+
+
+#include "prof.h"
+
+#include <cstdlib>
+#include <new>
+
+
+/*
+ *
+ * Replaces the global allocation functions, so only compiled in with NXLIB_PROFILE_ALLOCATIONS.
+ * Kept out of prof.cpp, the profiler itself must not see these inlined into its own code.
+ *
+ */
+#ifdef NXLIB_PROFILE_ALLOCATIONS
+
+static void *profiled_alloc(const size_t size, const size_t align)
+{
+    void *ptr;
+    if (align <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+    {
+        ptr = malloc(size != 0 ? size : 1);
+    }
+    else if (posix_memalign(&ptr, align, size != 0 ? size : 1) != 0)
+    {
+        ptr = nullptr;
+    }
+
+    if (ptr != nullptr)
+    {
+        NXlib::GlobalProfiler::allocated(size);
+    }
+
+    return ptr;
+}
+
+static void *profiled_new(const size_t size, const size_t align)
+{
+    for (;;)
+    {
+        if (void *ptr = profiled_alloc(size, align); ptr != nullptr)
+        {
+            return ptr;
+        }
+
+        const std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        handler();
+    }
+}
+
+void *operator new(size_t size) { return profiled_new(size, 0); }
+void *operator new[](size_t size) { return profiled_new(size, 0); }
+void *operator new(size_t size, std::align_val_t align) { return profiled_new(size, static_cast<size_t>(align)); }
+void *operator new[](size_t size, std::align_val_t align) { return profiled_new(size, static_cast<size_t>(align)); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return profiled_alloc(size, 0); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return profiled_alloc(size, 0); }
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return profiled_alloc(size, static_cast<size_t>(align)); }
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept { return profiled_alloc(size, static_cast<size_t>(align)); }
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { free(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { free(ptr); }
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { free(ptr); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { free(ptr); }
+#endif
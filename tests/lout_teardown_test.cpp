@@ -0,0 +1,170 @@
+/*
+
+    MIT Open Source License
+
+    Copyright (c) 2024 Melwin Svensson
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in (the "Software") without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of (the "Software"), subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of (the "Software").
+
+    Any modifications to (the "Software") must include a prominent notice stating that
+    (the "Software") was created by Melwin Svensson, and that the modifications were made
+    by a different author. The notice must explicitly state that Melwin Svensson created
+    the precursor to the current work, and that (the "Software") has been modified since its
+    original creation. Additionally, a link to the original source code (https://github.com/mellw0101)
+    must be included in a format similar to the following:
+
+    "Melwin Svensson CREATED THE PRECURSOR TO 'the current file' AND IS THE SOLE OWNER AND AUTHOR OF THE PRECURSOR WORK."
+
+    All copies, substantial portions, and derivative works of (the "Software") must be distributed
+    under the exact same license (MIT Open Source License) including all clauses stated in this
+    notice, ensuring that (the "Software") remains free and open source forever.
+
+    Any distribution of (the "Software") in its entirety or in portions, including
+    any derivative works, must retain this license in its entirety and may not be
+    re-licensed under any other license than the same MIT Open Source License.
+    All clauses laid out in this notice must be upheld in all future licenses for (the "Software").
+
+    Any software that includes (the "Software") or any portions of (the "Software") must also be
+    open source and distributed under a license that complies with the Open Source Definition
+    (https://opensource.org/osd).
+
+    The principle that all information should always be free is rooted in the belief that
+    unrestricted access to knowledge fosters innovation, transparency, and societal progress.
+    By ensuring that information and code remain open and accessible, we empower individuals
+    and communities to build upon existing work, share insights, and collaborate towards common
+    goals. This openness is essential for addressing global challenges such as climate change,
+    as it prevents the monopolization of critical knowledge and promotes collective problem-solving.
+    Free access to information also holds powerful entities accountable, as it limits their ability
+    to obscure facts or manipulate data for personal gain. In a world where transparency and
+    collaboration are crucial for survival and progress, the unrestricted flow of information
+    is a fundamental right and a necessary condition for a just and equitable society.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH (the "Software") OR THE USE OR OTHER DEALINGS IN (the "Software").
+
+*/
+
+/*
+    Logging from static destructors, after the thread's own 'lout' would have been destroyed.
+
+    usage: lout_teardown_test
+
+    A child process logs once from 'main' and once from the destructor of a static object,
+    which runs after the thread_local destructors and after the writer's own 'atexit' drain.
+    The test passes when the child exits cleanly and both lines are in its log, for the
+    text and for the JSON format, with and without rotation. Run under UBSan or ASan to
+    catch use after destruction.
+*/
+
+
+
+
+#include "lout.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/wait.h>
+
+
+using namespace std;
+
+
+/* Only set in the child, the parent exits without logging */
+static bool log_on_exit = false;
+
+typedef struct late_logger_t {
+    ~late_logger_t()
+    {
+        if (log_on_exit)
+        {
+            loutE << "logged from a static destructor" << loutEND;
+        }
+    }
+} late_logger_t;
+
+static late_logger_t late_logger;
+
+static bool run_child(const string &directory, const log_format_t format, const u64 max_segment_bytes)
+{
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        LogWriter &writer = LogWriter::instance();
+        writer.set_log_directory(directory);
+        writer.set_log_format(format);
+        writer.set_rotation(max_segment_bytes, 4);
+        Lout::set_deferred_formatting(true);
+
+        log_on_exit = true;
+        loutI << "logged from main " << 42 << loutEND;
+        exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "format %d, rotation %lu: child did not exit cleanly, status %d\n", format, max_segment_bytes, status);
+        return false;
+    }
+
+    const string path = directory + "/nlog";
+    stringstream log;
+    log << ifstream(path).rdbuf();
+    unlink(path.c_str());
+
+    bool passed = true;
+    for (const char *expected : {"logged from main", "logged from a static destructor"})
+    {
+        if (log.str().find(expected) == string::npos)
+        {
+            fprintf(stderr, "format %d, rotation %lu: '%s' is missing from the log\n", format, max_segment_bytes, expected);
+            passed = false;
+        }
+    }
+
+    return passed;
+}
+
+int main()
+{
+    char directory[] = "/tmp/lout_teardown_test.XXXXXX";
+    if (mkdtemp(directory) == nullptr)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    bool passed = true;
+    for (const log_format_t format : {LOG_FORMAT_COLOR, LOG_FORMAT_JSON})
+    {
+        for (const u64 max_segment_bytes : {u64(0), u64(1 << 20)})
+        {
+            passed &= run_child(directory, format, max_segment_bytes);
+        }
+    }
+
+    rmdir(directory);
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
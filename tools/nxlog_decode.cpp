@@ -0,0 +1,249 @@
+/*
+
+    MIT Open Source License
+
+    Copyright (c) 2024 Melwin Svensson
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in (the "Software") without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of (the "Software"), subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of (the "Software").
+
+    Any modifications to (the "Software") must include a prominent notice stating that
+    (the "Software") was created by Melwin Svensson, and that the modifications were made
+    by a different author. The notice must explicitly state that Melwin Svensson created
+    the precursor to the current work, and that (the "Software") has been modified since its
+    original creation. Additionally, a link to the original source code (https://github.com/mellw0101)
+    must be included in a format similar to the following:
+
+    "Melwin Svensson CREATED THE PRECURSOR TO 'the current file' AND IS THE SOLE OWNER AND AUTHOR OF THE PRECURSOR WORK."
+
+    All copies, substantial portions, and derivative works of (the "Software") must be distributed
+    under the exact same license (MIT Open Source License) including all clauses stated in this
+    notice, ensuring that (the "Software") remains free and open source forever.
+
+    Any distribution of (the "Software") in its entirety or in portions, including
+    any derivative works, must retain this license in its entirety and may not be
+    re-licensed under any other license than the same MIT Open Source License.
+    All clauses laid out in this notice must be upheld in all future licenses for (the "Software").
+
+    Any software that includes (the "Software") or any portions of (the "Software") must also be
+    open source and distributed under a license that complies with the Open Source Definition
+    (https://opensource.org/osd).
+
+    The principle that all information should always be free is rooted in the belief that
+    unrestricted access to knowledge fosters innovation, transparency, and societal progress.
+    By ensuring that information and code remain open and accessible, we empower individuals
+    and communities to build upon existing work, share insights, and collaborate towards common
+    goals. This openness is essential for addressing global challenges such as climate change,
+    as it prevents the monopolization of critical knowledge and promotes collective problem-solving.
+    Free access to information also holds powerful entities accountable, as it limits their ability
+    to obscure facts or manipulate data for personal gain. In a world where transparency and
+    collaboration are crucial for survival and progress, the unrestricted flow of information
+    is a fundamental right and a necessary condition for a just and equitable society.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH (the "Software") OR THE USE OR OTHER DEALINGS IN (the "Software").
+
+*/
+
+/*
+    Renders a binary log written by 'LogWriter::set_binary_output'.
+
+    usage: nxlog-decode [--json] [file]
+
+    Without --json the output is the same colored text the text log contains,
+    with --json every message is one JSON object per line. Reads stdin without a file.
+    Gzipped segments are decompressed on the fly.
+*/
+
+
+
+
+#include "lout.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <zlib.h>
+
+
+using namespace std;
+
+
+typedef struct site_t {
+    LogLevel level;
+    i32      line;
+    string   function;
+    string   file;
+} site_t;
+
+class Reader
+{
+public:
+    explicit Reader(const string &data)
+    : data(data)
+    {}
+
+    template<typename T>
+    bool get(T &value)
+    {
+        if (data.size() - pos < sizeof(T))
+        {
+            return false;
+        }
+
+        memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    bool get(string &value)
+    {
+        u16 len;
+        if (!get(len) || data.size() - pos < len)
+        {
+            return false;
+        }
+
+        value.assign(data.data() + pos, len);
+        pos += len;
+        return true;
+    }
+
+    bool get_bytes(char *out, const size_t len)
+    {
+        if (data.size() - pos < len)
+        {
+            return false;
+        }
+
+        memcpy(out, data.data() + pos, len);
+        pos += len;
+        return true;
+    }
+
+private:
+    const string &data;
+    size_t pos = 0;
+};
+
+/// Reads plain and gzipped input alike, zlib passes data without a gzip header through.
+static string read_all(gzFile in)
+{
+    string data;
+    char   chunk[64 * 1024];
+    int    n;
+    while ((n = gzread(in, chunk, sizeof(chunk))) > 0)
+    {
+        data.append(chunk, static_cast<size_t>(n));
+    }
+
+    return data;
+}
+
+int main(const int argc, char **argv)
+{
+    bool        json = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = true;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    gzFile in = path ? gzopen(path, "rb") : gzdopen(dup(STDIN_FILENO), "rb");
+    if (in == nullptr)
+    {
+        perror(path ? path : "stdin");
+        return 1;
+    }
+
+    const string data = read_all(in);
+    gzclose(in);
+
+    if (data.size() < sizeof(LOG_BINARY_MAGIC) || memcmp(data.data(), LOG_BINARY_MAGIC, sizeof(LOG_BINARY_MAGIC)) != 0)
+    {
+        fprintf(stderr, "%s: not an NXlib binary log\n", path ? path : "stdin");
+        return 1;
+    }
+
+    Reader reader(data);
+    char   magic[sizeof(LOG_BINARY_MAGIC)];
+    reader.get_bytes(magic, sizeof(magic));
+
+    map<u32, site_t> sites;
+    LogMessage       message{};
+    string           out;
+    u8               type;
+    while (reader.get(type))
+    {
+        if (type == LOG_RECORD_SITE)
+        {
+            u32    id;
+            u8     level;
+            site_t site;
+            if (!reader.get(id) || !reader.get(level) || !reader.get(site.line) || !reader.get(site.function) || !reader.get(site.file))
+            {
+                break;
+            }
+
+            site.level = static_cast<LogLevel>(level);
+            sites[id]  = move(site);
+        }
+        else if (type == LOG_RECORD_MESSAGE)
+        {
+            u64 time_ns;
+            u8  level;
+            u32 id;
+            if (!reader.get(time_ns) || !reader.get(level) || !reader.get(id) || !reader.get(message.encoding) || !reader.get(message.message_len)
+             || message.message_len > LOG_MESSAGE_MAX || !reader.get_bytes(message.message, message.message_len))
+            {
+                break;
+            }
+
+            const auto site = sites.find(id);
+            message.time     = chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(time_ns)));
+            message.level    = static_cast<LogLevel>(level);
+            message.line     = site != sites.end() ? site->second.line : 0;
+            message.function = site != sites.end() ? site->second.function.c_str() : "?";
+            message.file     = site != sites.end() ? site->second.file.c_str() : "?";
+
+            json ? format_log_json(out, message) : format_log_line(out, message);
+        }
+        else if (type == 0)
+        {
+            /* Unused preallocation at the end of a segment from a session that did not exit cleanly */
+            break;
+        }
+        else
+        {
+            fprintf(stderr, "corrupt record type %u, stopping\n", type);
+            break;
+        }
+
+        if (out.size() > 64 * 1024)
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+
+    fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
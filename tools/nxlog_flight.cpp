@@ -0,0 +1,234 @@
+/*
+
+    MIT Open Source License
+
+    Copyright (c) 2024 Melwin Svensson
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in (the "Software") without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of (the "Software"), subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of (the "Software").
+
+    Any modifications to (the "Software") must include a prominent notice stating that
+    (the "Software") was created by Melwin Svensson, and that the modifications were made
+    by a different author. The notice must explicitly state that Melwin Svensson created
+    the precursor to the current work, and that (the "Software") has been modified since its
+    original creation. Additionally, a link to the original source code (https://github.com/mellw0101)
+    must be included in a format similar to the following:
+
+    "Melwin Svensson CREATED THE PRECURSOR TO 'the current file' AND IS THE SOLE OWNER AND AUTHOR OF THE PRECURSOR WORK."
+
+    All copies, substantial portions, and derivative works of (the "Software") must be distributed
+    under the exact same license (MIT Open Source License) including all clauses stated in this
+    notice, ensuring that (the "Software") remains free and open source forever.
+
+    Any distribution of (the "Software") in its entirety or in portions, including
+    any derivative works, must retain this license in its entirety and may not be
+    re-licensed under any other license than the same MIT Open Source License.
+    All clauses laid out in this notice must be upheld in all future licenses for (the "Software").
+
+    Any software that includes (the "Software") or any portions of (the "Software") must also be
+    open source and distributed under a license that complies with the Open Source Definition
+    (https://opensource.org/osd).
+
+    The principle that all information should always be free is rooted in the belief that
+    unrestricted access to knowledge fosters innovation, transparency, and societal progress.
+    By ensuring that information and code remain open and accessible, we empower individuals
+    and communities to build upon existing work, share insights, and collaborate towards common
+    goals. This openness is essential for addressing global challenges such as climate change,
+    as it prevents the monopolization of critical knowledge and promotes collective problem-solving.
+    Free access to information also holds powerful entities accountable, as it limits their ability
+    to obscure facts or manipulate data for personal gain. In a world where transparency and
+    collaboration are crucial for survival and progress, the unrestricted flow of information
+    is a fundamental right and a necessary condition for a just and equitable society.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH (the "Software") OR THE USE OR OTHER DEALINGS IN (the "Software").
+
+*/
+
+/*
+    Extracts the messages held by a 'LogFlightRecorder' ring, oldest first.
+
+    usage: nxlog-flight <ring file>
+
+    Works on the file of a running process, of one that crashed, or on the
+    '<path>.prev' copy a restarted process left behind. Records that were
+    being written at the moment of the crash are skipped.
+*/
+
+
+
+
+#include "lout.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using namespace std;
+
+
+using flight_header_t = LogFlightRecorder::flight_header_t;
+using flight_record_t = LogFlightRecorder::flight_record_t;
+
+class Ring
+{
+public:
+    Ring(const char *data, const u64 capacity)
+    : data(data), capacity(capacity)
+    {}
+
+    /* Copies 'len' bytes at absolute position 'pos', following the wraparound */
+    void read(const u64 pos, void *out, const size_t len) const
+    {
+        const size_t offset = pos % capacity;
+        const size_t first  = std::min(len, static_cast<size_t>(capacity - offset));
+        memcpy(out, data + offset, first);
+        memcpy(static_cast<char *>(out) + first, data, len - first);
+    }
+
+    [[nodiscard]] bool valid(const u64 pos, flight_record_t &record) const
+    {
+        read(pos, &record, sizeof(record));
+        return record.marker == LogFlightRecorder::RECORD_MARKER && record.pos == pos
+            && record.len <= capacity - sizeof(record);
+    }
+
+private:
+    const char *data;
+    u64 capacity;
+};
+
+static bool decode(const string &payload, LogMessage &message, string &function)
+{
+    const char *p   = payload.data();
+    const char *end = p + payload.size();
+    const size_t fixed = sizeof(u64) + 2 + sizeof(i32) + sizeof(u16);
+    if (payload.size() < fixed)
+    {
+        return false;
+    }
+
+    u64 time_ns;
+    u16 len;
+    memcpy(&time_ns, p, sizeof(time_ns));          p += sizeof(time_ns);
+    message.level    = static_cast<LogLevel>(*p++);
+    message.encoding = static_cast<u8>(*p++);
+    memcpy(&message.line, p, sizeof(message.line)); p += sizeof(message.line);
+    memcpy(&len, p, sizeof(len));                   p += sizeof(len);
+    if (end - p < len + static_cast<long>(sizeof(u16)))
+    {
+        return false;
+    }
+
+    function.assign(p, len);                        p += len;
+    memcpy(&len, p, sizeof(len));                   p += sizeof(len);
+    if (end - p < len || len > LOG_MESSAGE_MAX)
+    {
+        return false;
+    }
+
+    memcpy(message.message, p, len);
+    message.message_len = len;
+    message.time        = chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(time_ns)));
+    message.function    = function.c_str();
+    message.file        = "?";
+    return true;
+}
+
+int main(const int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <ring file>\n", argv[0]);
+        return 1;
+    }
+
+    const int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (static_cast<size_t>(st.st_size) < sizeof(flight_header_t))
+    {
+        fprintf(stderr, "%s: not an NXlib flight recorder ring\n", argv[1]);
+        return 1;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    const auto *header = static_cast<const flight_header_t *>(map);
+    if (memcmp(header->magic, LogFlightRecorder::MAGIC, sizeof(LogFlightRecorder::MAGIC)) != 0
+     || header->capacity == 0 || header->capacity > st.st_size - sizeof(flight_header_t))
+    {
+        fprintf(stderr, "%s: not an NXlib flight recorder ring\n", argv[1]);
+        return 1;
+    }
+
+    const Ring ring(reinterpret_cast<const char *>(header + 1), header->capacity);
+    const u64  head = header->head.load(memory_order_acquire);
+
+    /* The oldest records were partly overwritten, look for the first intact one */
+    u64 pos = head > header->capacity ? head - header->capacity : 0;
+    flight_record_t record{};
+    while (pos < head && !ring.valid(pos, record))
+    {
+        ++pos;
+    }
+
+    LogMessage message{};
+    string     function, payload, out;
+    while (pos + sizeof(record) <= head)
+    {
+        if (!ring.valid(pos, record))
+        {
+            /* Torn by the crash, its successors may still be complete */
+            do
+            {
+                ++pos;
+            }
+            while (pos < head && !ring.valid(pos, record));
+            continue;
+        }
+
+        payload.resize(record.len);
+        ring.read(pos + sizeof(record), payload.data(), record.len);
+        if (decode(payload, message, function))
+        {
+            format_log_line(out, message);
+        }
+
+        pos += sizeof(record) + record.len;
+        if (out.size() > 64 * 1024)
+        {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+
+    fwrite(out.data(), 1, out.size(), stdout);
+    munmap(map, st.st_size);
+    return 0;
+}